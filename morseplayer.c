@@ -32,11 +32,20 @@
  *  April 1990 (http://www.arrl.org/files/infoserv/tech/code-std.txt)
  */
 
+#if defined(__linux__)
+#define	_GNU_SOURCE		/* CPU_SET(), pthread_setaffinity_np() */
+#endif
+
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include "portaudio.h"
-#include <sys/queue.h>
 #include <sys/poll.h>
+#include <netdb.h>
 #include <string.h>
 #include <fcntl.h>
 #include <err.h>
@@ -49,78 +58,754 @@
 #include <ctype.h>
 #include <limits.h>
 #include <float.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #ifndef BYTE_ORDER
 #error "no byte order defined"
 #endif
 
+/*
+ * Sounds are mono and stored in the sample format of their sound set, so
+ * that playing them is a straight copy.  All formats are native byte
+ * order; zero is silence in every one of them.
+ */
+#define	SF_F32		0		/* 32 bit float */
+#define	SF_S16		1		/* 16 bit signed */
+#define	SF_S24		2		/* packed 24 bit signed */
+#define	SF_NFMT		3
+
+const u_int sf_bps[SF_NFMT] = { 4, 2, 3 };	/* bytes per sample */
+const char *sf_name[SF_NFMT] = { "f32", "s16", "s24" };
+
+/*
+ * Tone edges (-E).  The exponential one is the original: a step on and a
+ * quick decay off.  The others shape both edges the same way, which
+ * keeps the clicks of keying out of the neighbouring frequencies.
+ */
+#define	ENV_EXP		0		/* step on, exponential off */
+#define	ENV_COS		1		/* raised cosine */
+#define	ENV_BH		2		/* half a Blackman-Harris window */
+#define	ENV_NSHAPE	3
+
+const char *env_name[ENV_NSHAPE] = { "exp", "cos", "bh" };
+
+/*
+ * An edge is worked out once for each shape, length and rate, and kept
+ * for good: every sound set with those shares it, whatever its other
+ * rates.  et_fall[k] is the level k samples into the falling edge, k up
+ * to et_len where it has ended; et_rise[k] is the rising edge the same
+ * way, or NULL for a step.
+ */
+struct env_tab {
+	int et_shape;
+	u_int et_len;
+	u_int et_rate;
+	float *et_fall;
+	float *et_rise;
+	struct env_tab *et_next;
+};
+
+/*
+ * A sound is a run of segments, each either samples or (with no buffer)
+ * silence.  Segments may point into buffers that belong to other sounds
+ * of the same set: every dit and dah starts with the set's shared tone,
+ * and a character is just the segments of its elements.
+ */
+struct a_seg {
+	const void *sg_buf;		/* samples, NULL for silence */
+	u_int sg_len;
+};
+
 struct a_sound {
-	u_int len;
-	float *buf;
+	u_int len;			/* samples, all segments */
+	u_int flags;
+	void *buf;			/* samples owned by this sound */
+	u_int nseg;
+	struct a_seg *seg;
+	struct a_seg seg1;		/* seg, for a sound of one segment */
+};
+#define	SND_SILENT	0x0001		/* all zeros, no buffer at all */
+#define	SND_ARENA	0x0002		/* buf and seg are in the set's arena */
+
+/*
+ * The memory behind a sound set's sounds comes out of an arena:
+ * sound_size() works out from the lengths how much a set needs, and the
+ * first chunk is made that big, so building a set is normally one
+ * allocation and freeing it one free.  Should it ever run short (or be
+ * given more, as synth_check() does) further chunks are chained on.
+ * Nothing in it is freed but the whole.
+ */
+#define	AR_ALIGN	16
+
+struct ar_chunk {
+	struct ar_chunk *ac_next;
+	size_t ac_size;			/* bytes after the header */
+	size_t ac_used;
+};
+#define	AR_HDR	((sizeof(struct ar_chunk) + AR_ALIGN - 1) & ~(AR_ALIGN - 1))
+#define	AR_ROUND(n)	(((n) + AR_ALIGN - 1) & ~(size_t)(AR_ALIGN - 1))
+
+/*
+ * With -K the samples of a set (edge table, tone and element edges) are
+ * kept in a sound bank file instead, one per bank_key, which is all they
+ * depend on; the overall rate and block size only set lengths of
+ * silence.  A bank is written whole under a temporary name and renamed
+ * into place, so it is either there and complete or not there, and is
+ * then only ever mapped read-only: every process playing at the same
+ * rate and pitch plays the same pages of the page cache.
+ */
+#define	BANK_MAGIC	"MPBANK\0\0"	/* 8 bytes */
+#define	BANK_VERSION	2
+#define	BANK_ORDER	0x01020304	/* as stored, for the byte order */
+
+struct bank_key {
+	u_int bk_version;
+	u_int bk_order;
+	u_int bk_rate;
+	int bk_fmt;			/* SF_* */
+	float bk_hz;
+	double bk_cwpm;
+	int bk_env;			/* edge shape, ENV_* */
+	u_int bk_envlen;		/* ... and length */
+	u_int bk_tonelen;
+	u_int bk_ditlen, bk_dahlen;
+};
+
+struct bank_hdr {
+	char bh_magic[8];		/* written last */
+	struct bank_key bh_key;
+	u_int64_t bh_size;		/* of the whole file */
 };
+#define	BANK_HDR	AR_ROUND(sizeof(struct bank_hdr))
+
+/*
+ * The play list is a single-producer/single-consumer ring shared between
+ * main_loop (producer) and mp_callback (consumer).  The producer owns
+ * ph_tail and ph_queued, the consumer owns ph_head and ph_played; slots
+ * between head and tail belong to the consumer.  Nothing here is ever
+ * allocated or freed once the ring is initialized.
+ */
+#define	PL_RINGSIZE	1024		/* must be a power of two */
 
 struct play_list {
-	STAILQ_ENTRY(play_list) pl_nxt;
-	struct a_sound *pl_snd;
-	float *pl_ptr;
-	u_int pl_res;
+	struct a_sound *pl_snd;		/* sound being played */
+	u_int pl_seg;			/* segment being played */
+	u_int pl_off;			/* offset of next sample in it */
+	u_int pl_res;			/* samples remaining */
+	u_int64_t pl_time;		/* when its text was read, ns */
 };
 
 struct play_head {
-	STAILQ_HEAD(, play_list)	l;
-	int nent;
-	int nsamps;
+	struct play_list ph_ring[PL_RINGSIZE];
+	atomic_uint ph_head;		/* next slot to play */
+	atomic_uint ph_tail;		/* next slot to fill */
+	atomic_uint ph_queued;		/* samples ever queued */
+	atomic_uint ph_played;		/* samples ever played */
+	u_int64_t ph_stamp;		/* pl_time for what is queued next */
+};
+
+/*
+ * Everything that depends on the rate and pitch.  Once built, a sound set
+ * is only read, so any number of play lists (and threads) may share one.
+ */
+#define	NMORSE		44		/* entries in morse_chars */
+#define	MT_MAX		4096		/* ... and in all of morse_code */
+#define	MC_MAXEL	16		/* elements in any character */
+
+struct sound_set {
+	u_int ss_rate;		/* sample rate */
+	int ss_fmt;		/* sample format, SF_* */
+	u_int ss_bps;		/* ... and its bytes per sample */
+	float ss_hz;		/* audio frequency */
+	double ss_owpm;		/* overall rate */
+	double ss_cwpm;		/* character rate */
+	u_int ss_ditlen;	/* dit length */
+	u_int ss_dahlen;	/* dah length */
+	u_int ss_inCharlen;	/* interCharacter length */
+	u_int ss_inWordlen;	/* interWord length */
+	u_int ss_blocksize;	/* audio block size */
+	int ss_envshape;	/* ENV_* */
+	float *ss_env;		/* falling edge of a tone */
+	float *ss_rise;		/* ... and rising edge, or NULL for a step */
+	u_int ss_envlen;	/* ... in samples, each */
+	void *ss_tone;		/* steady tone, shared by dits and dahs */
+	u_int ss_tonelen;	/* ... in samples */
+	struct a_sound ss_dit, ss_dah, ss_quiet;
+	struct a_sound ss_gap;	/* silence of any length, for timelines */
+	struct a_sound *ss_chars;	/* parallel to morse_code */
+	struct ar_chunk *ss_arena;	/* samples and segments live here */
+	u_char *ss_bank;	/* ... or the samples, if mapped from a bank */
+	size_t ss_banksize;	/* ... its length */
+	size_t ss_bankused;	/* ... and how much is handed out */
+	int ss_banked;		/* the bank already holds the samples */
+	struct sound_set *ss_next;	/* retired sets, see engine_swap() */
+	u_int ss_retire;	/* last played with this play list slot */
+};
+
+/*
+ * Where tl_compile() is in the text, so that it can stop anywhere and
+ * pick up again with the next read: in a run of white space, part way
+ * through a UTF-8 sequence, or in a <macro> name.
+ */
+#define	MAC_MAX		8		/* longest macro name */
+
+struct tl_state {
+	int ts_space;			/* seen a space character? */
+	u_int ts_cp;			/* code point so far */
+	u_int ts_need;			/* ... and bytes still to come */
+	int ts_inmac;			/* in a <macro> */
+	u_int ts_nmac;
+	char ts_mac[MAC_MAX];		/* ... and the name so far */
+};
+
+/*
+ * A morse engine turns text into queued sound and queued sound into
+ * samples.  Engines share nothing but (optionally) a read-only sound set,
+ * so any number of them can run in one process.
+ *
+ * Given a whole timeline instead (engine_timeline()), the callback plays
+ * straight from that and can be sent anywhere in it through e_seek; the
+ * play list counters then just track what is left.  Either way e_paused
+ * stops the engine where it is.
+ *
+ * An engine that owns its sounds can be handed a new set at any time
+ * (e_next); the producer changes over at the next character and keeps
+ * the old set on e_retired until the callback has played past it.
+ */
+struct engine {
+	struct sound_set *e_ss;		/* sounds being queued */
+	struct sound_set *e_own;	/* ... if the engine owns them */
+	_Atomic(struct sound_set *) e_next;	/* set to change to */
+	struct sound_set *e_retired;	/* sets still being played */
+	u_int e_bps;			/* bytes per sample, for the callback */
+	u_int e_rate;			/* ... and sample rate */
+	struct mp_stats *e_stats;	/* latencies go here, if anywhere */
+	u_int64_t e_dac;		/* when this block will be heard, ns */
+	atomic_int e_paused;		/* play silence, hold everything */
+	struct play_head e_ph;		/* queued sound */
+	struct timeline *e_tl;		/* play this instead, if set */
+	size_t e_tlent;			/* ... entry being played */
+	u_int e_tloff;			/* ... and the offset in it */
+	_Atomic(u_int64_t) e_seek;	/* go to this (tl_where()) */
+	_Atomic(u_int64_t) e_pos;	/* the sample being played */
+	struct tl_state e_ts;		/* where engine_text() is */
+};
+
+/*
+ * Buffered text input.  Regular files are mapped whole; anything else is
+ * read into a buffer that doubles (up to ib_max) whenever a read fills
+ * it.  Text between ib_off and ib_len has not been queued yet.
+ */
+#define	IN_MINBUF	16384
+#define	IN_MAXBUF	(1024 * 1024)
+
+struct in_buf {
+	int ib_fd;
+	u_char *ib_buf;
+	size_t ib_size;			/* size of ib_buf */
+	size_t ib_max;			/* ... which may grow to this */
+	size_t ib_off;			/* next byte to queue */
+	size_t ib_len;			/* end of valid data */
+	int ib_mapped;			/* ib_buf is the whole file */
+};
+
+/*
+ * Text compiled down to what is to be played: a flat run of entries,
+ * each a character's sound or a gap of silence.  Adjacent silences, a
+ * character's space and the word space after it, are merged into one
+ * gap.  Lengths are those of the sound set it was compiled against.
+ */
+#define	TL_GAP		0xffff		/* te_snd for silence */
+#define	TL_CHUNK	64		/* engine_text() entries made at once */
+
+struct tl_ent {
+	u_short te_snd;			/* index in ss_chars, or TL_GAP */
+	u_int te_len;			/* samples */
+};
+
+struct timeline {
+	struct tl_ent *tl_ent;
+	size_t tl_n;
+	size_t tl_size;			/* entries allocated */
+	u_int64_t tl_samps;		/* samples, all entries */
+	/* for seeking, from tl_index() */
+	u_int64_t *tl_start;		/* first sample of each entry */
+	size_t *tl_toff;		/* ... and the text it came from */
+	size_t *tl_para;		/* where each paragraph starts */
+	size_t tl_npara;
+};
+#define	TL_NOSEEK	(~(u_int64_t)0)	/* e_seek with nowhere to go */
+
+/*
+ * One station in the live mix: an engine fed from its own text source,
+ * panned and scaled into the stereo output.  A lone unity voice is
+ * copied rather than mixed.
+ */
+struct voice {
+	struct engine *v_eng;
+	int v_fd;			/* text source */
+	struct in_buf v_in;		/* ... and its buffer */
+	int v_eof;			/* ... has run dry */
+	int v_mix;			/* mix with v_gain instead of copying */
+	int v_fmt;			/* sample format of its sounds */
+	struct timeline *v_tl;		/* its text compiled, with -T */
+	float v_owpm, v_cwpm, v_hz;
+	float v_gain[2];		/* left and right gain */
+	u_int v_wakeat;			/* wake main_loop at this depth... */
+	atomic_int v_wait;		/* ... if it is waiting on this voice */
+};
+
+#define	MAXVOICES	256
+
+/*
+ * What the audio callback has seen, for -S and SIGUSR1.  The callback is
+ * the only writer (but for the latencies, which come from whoever runs
+ * engine_render()); stats_report() reads the counters and exchanges the
+ * per-report figures (queue depths and latencies) back to their start
+ * values.  Nothing here takes a lock.
+ */
+#define	CB_NHIST	12		/* < 1us, < 2us, ... < 1024us, more */
+
+struct mp_stats {
+	atomic_ulong ms_calls;
+	atomic_ulong ms_underflow;	/* paOutputUnderflow */
+	atomic_ulong ms_overflow;	/* paOutputOverflow */
+	atomic_ulong ms_starved;	/* callbacks short of render_q blocks */
+	atomic_ulong ms_hist[CB_NHIST];	/* time spent in the callback */
+	atomic_ulong ms_cbmax;		/* ... the longest, ns */
+	atomic_uint ms_qmin, ms_qmax;	/* shallowest queue, samples */
+	atomic_uint ms_emin, ms_emax;	/* ... and play list entries */
+	atomic_ulong ms_nlat;		/* characters started */
+	atomic_ulong ms_latsum;		/* ... their text to audio latency */
+	atomic_ulong ms_latmax;		/* ... the worst of it, ns */
+	/* with -l */
+	atomic_ulong ms_locked;		/* bytes locked into memory */
+	atomic_ulong ms_lockerr;	/* mlock() failures */
+	atomic_int ms_lockerrno;	/* ... the last one's errno */
+	atomic_ulong ms_rterr;		/* scheduling or pinning failures */
+	atomic_int ms_rterrno;		/* ... the last one's errno */
+};
+
+/*
+ * With -l the callback runs SCHED_FIFO at RT_PRIO on a CPU of its own,
+ * the render thread for -a just below it, and everything the audio path
+ * reads is locked into memory.
+ */
+#define	RT_PRIO		60
+
+#define	KEYER_FRAMES	64		/* default block size with -k */
+#define	MIX_FRAMES	1024		/* frames mixed at a time */
+
+/*
+ * With -a a render thread keeps the audio some blocks ahead of the
+ * callback, each block already mixed and in the device's format, and
+ * all the callback does is copy them out; every engine is then run on
+ * the render thread instead.  Blocks are rq_frames long and start on
+ * cache lines.  The queue is single-producer/single-consumer like the
+ * play list: the thread owns rq_tail, the callback rq_head and rq_off.
+ * The callback never wakes the thread, which would be a system call:
+ * the thread just sleeps while half the queue plays out.
+ */
+#define	RQ_FRAMES	256		/* block size, unless -B says */
+#define	RQ_MAXBLK	1024		/* most blocks ahead */
+#define	RQ_ALIGN	64
+
+struct render_q {
+	u_int rq_ahead;			/* blocks in the ring */
+	u_int rq_frames;		/* frames in a block */
+	size_t rq_len;			/* ... bytes of them */
+	size_t rq_stride;		/* ... and from block to block */
+	u_char *rq_buf;
+	atomic_uint rq_head;		/* next block to play */
+	atomic_uint rq_tail;		/* next block to fill */
+	size_t rq_off;			/* bytes of the head block played */
+	u_int64_t rq_latency;		/* of the stream, ns */
+	atomic_int rq_stop;
+	pthread_t rq_tid;
 };
 
 struct s_params {
 	u_int sp_rate;		/* sample rate */
-	float sp_hz;		/* audio frequency */
-	u_int sp_ditlen;	/* dit length */
-	u_int sp_dahlen;	/* dah length */
-	u_int sp_inCharlen;	/* interCharacter length */
+	int sp_fmt;		/* output sample format */
+	u_int sp_chans;		/* output channels, 1 or 2 */
 	u_int sp_sampthresh;	/* threshold for queuing more audio */
-	u_int sp_blocksize;	/* audio block size */
-	int sp_seenspace;	/* seen a space character? */
+	u_int sp_lowat;		/* refill once the queue drops below this */
+	u_int sp_blocksize;	/* audio block size, 0 if up to portaudio */
+	int sp_wakefd[2];	/* pipe the callback uses to wake main_loop */
+	size_t sp_inbuf;	/* largest text input buffer */
+	struct engine *sp_eng;	/* engine to render to a file */
+	struct voice *sp_voices;	/* engines to play live */
+	u_int sp_nvoices;
 	PaStream *sp_stream;	/* audio stream */
+	const char *sp_ctl;	/* control file, if any */
+	pthread_t sp_ctltid;	/* ... and the thread reading it */
+	struct out_file *sp_out;	/* file output instead of a stream */
+	struct mp_stats sp_stats;	/* kept by the callback */
+	float sp_statint;	/* seconds between reports, 0 for none */
+	u_int64_t sp_stat0;	/* when the stream started, ns */
+	u_int64_t sp_statnext;	/* when the next report is due */
+	u_long sp_statcalls;	/* callbacks as of the last report */
+	struct render_q *sp_rq;	/* rendering ahead, with -a */
+	int sp_rt;		/* -l */
+	int sp_rtcpu;		/* ... the callback's CPU, or -1 */
+	int sp_rtdone;		/* ... and the callback has moved there */
+	u_long sp_lockerr;	/* failures main_loop has reported */
+	u_long sp_rterr;
+	float sp_mix[2 * MIX_FRAMES];	/* stereo mix ahead of conversion */
+};
+
+/*
+ * A timing sweep (test_times()): rows of the grid are handed out to the
+ * workers through ts_next, and their statistics gathered under ts_lock.
+ */
+struct tsweep {
+	u_int ts_rate;
+	float ts_step;
+	u_int ts_nrows;
+	int ts_mr;			/* machine readable output */
+	atomic_uint ts_next;		/* next row to hand out */
+	pthread_mutex_t ts_lock;
+	u_long ts_n, ts_over;		/* points, and points over TIME_TOL */
+	double ts_max, ts_maxo, ts_maxc;	/* worst error, and where */
+	double ts_sum, ts_sumsq;
+};
+
+/* what the control thread has to let go of if cancelled */
+struct ctl_state {
+	FILE *cs_f;
+	char *cs_line;
+	size_t cs_linesz;
+};
+
+/*
+ * Offline rendering to a file or pipe.  The sounds are built in the
+ * output format, so they are written straight out of the sound buffers
+ * with writev().  Integer samples are little endian in the file; on a big
+ * endian host they are swapped into of_buf first.
+ */
+#define	OF_WAV		0		/* mono WAV */
+#define	OF_RAW		1		/* raw mono samples */
+
+#define	OF_NIOV		1024
+#define	OF_BUFLEN	98304		/* bytes, a multiple of 2, 3 and 4 */
+#define	OF_WAVHDR	44
+
+struct out_file {
+	int of_fd;
+	int of_type;
+	int of_fmt;			/* sample format */
+	u_int of_bps;			/* ... and its bytes per sample */
+	u_int of_rate;			/* sample rate */
+	u_int64_t of_frames;		/* frames written so far */
+	u_int of_niov;
+	struct iovec of_iov[OF_NIOV];
+	u_int of_fill;			/* bytes used in of_buf */
+	u_char of_hdr[OF_WAVHDR];	/* first thing flushed, for wav */
+	u_char of_buf[OF_BUFLEN];
+};
+
+/*
+ * Batch rendering: each line of the job list names an input and an
+ * output, optionally followed by wpm, cwpm and frequency.  Jobs with the
+ * same rates and pitch share one sound set.
+ */
+struct batch_job {
+	char *bj_in;
+	char *bj_out;
+	struct sound_set *bj_ss;
+	int bj_err;
+};
+
+struct batch {
+	struct batch_job *b_jobs;
+	u_int b_njobs;
+	atomic_uint b_next;		/* next job to hand out */
+	int b_otype;			/* output file type */
+	int b_fmt;			/* ... sample format */
+	u_int b_rate;			/* ... and sample rate */
+	size_t b_inbuf;			/* largest text input buffer */
+};
+
+/*
+ * Serving the audio to listeners over TCP (-s).  It is rendered once, a
+ * block at a time as the clock comes round to it, into a ring of blocks
+ * that every listener is sent from.  A block's epoch is its number since
+ * the start; the slot it is in is reused for the epoch SV_NBLOCK later,
+ * so a listener still short of that is too far behind and is dropped.
+ * Text comes from the standard input and from UDP datagrams to the same
+ * port.
+ */
+#define	SV_NBLOCK	64		/* blocks in the ring */
+#define	SV_BLOCKMS	20		/* ... each this long */
+#define	SV_MAXCL	1024		/* listeners */
+#define	SV_DGRAM	65536		/* largest text datagram */
+
+struct sv_client {
+	int cl_fd;			/* -1 if the slot is free */
+	u_int cl_hdr;			/* header bytes sent */
+	u_int64_t cl_epoch;		/* block being sent */
+	u_int cl_off;			/* ... bytes of it sent */
+};
+
+struct server {
+	int sv_lfd;			/* listening socket */
+	int sv_ufd;			/* text datagrams */
+	struct engine *sv_eng;
+	struct in_buf sv_in;		/* standard input */
+	int sv_eof;			/* ... has run dry */
+	u_int sv_thresh;		/* keep this much queued */
+	u_int sv_blkframes;		/* frames in a block */
+	u_int sv_blklen;		/* ... and bytes */
+	int sv_fmt;			/* sample format */
+	u_char *sv_ring;		/* SV_NBLOCK blocks */
+	u_int64_t sv_epoch;		/* blocks rendered so far */
+	u_char sv_hdr[OF_WAVHDR];	/* sent to each listener first */
+	u_int sv_hdrlen;		/* ... 0 for raw samples */
+	u_char *sv_dgram;		/* datagram being queued */
+	size_t sv_doff, sv_dlen;
+	struct sv_client sv_cl[SV_MAXCL];
+	u_int sv_ncl;			/* slots ever used */
+	struct pollfd sv_pfd[3 + SV_MAXCL];
+};
+
+/*
+ * The decoder (-R, -A) listens to each channel of its input as a station
+ * of its own.  A Goertzel filter at the pitch is run over all channels
+ * together a block at a time, a few blocks to a dit; the power in each
+ * block says mark or space, and the lengths of marks and spaces are read
+ * against the lengths of the sound set the player would make at the
+ * same rates.  The dit length then follows the sender.
+ */
+#define	DEC_MAXCH	64		/* channels */
+#define	DEC_FRAMES	1024		/* frames read at a time */
+#define	DEC_BPU		8		/* blocks to a dit, at the rate given */
+#define	DEC_MINPOW	1e-6		/* no tone is quieter than this */
+#define	DEC_LINE	256		/* longest line of text held */
+
+struct dec_chan {
+	float dc_peak;			/* block power, the loudest lately */
+	float dc_floor;			/* ... and the noise */
+	int dc_mark;			/* in a tone */
+	u_int dc_flip;			/* blocks since it seemed not to be */
+	u_int dc_run;			/* blocks of this mark or space */
+	float dc_unit;			/* dit length, blocks */
+	u_int dc_nel;			/* marks in this character */
+	u_int dc_el[MC_MAXEL];		/* ... and their lengths */
+	int dc_gap;			/* sent for this space: DG_* */
+	int dc_space;			/* a word space before the next */
+	size_t dc_len;
+	char dc_line[DEC_LINE];		/* text not yet printed */
+};
+#define	DG_NONE		0
+#define	DG_CHAR		1		/* the character */
+#define	DG_WORD		2		/* ... and a space */
+#define	DG_LINE		3		/* ... and the end of the line */
+
+struct decoder {
+	u_int dk_nch;
+	u_int dk_block;			/* samples in a block */
+	u_int dk_n;			/* ... in this one so far */
+	float dk_coeff;			/* 2 cos w */
+	float dk_unit;			/* dit length asked for, blocks */
+	float dk_charth;		/* spaces longer end a character... */
+	float dk_wordth;		/* ... or a word, in dits */
+	float dk_idle;			/* ... or the line */
+	float dk_decay;			/* of dc_peak, each block */
+	short dk_bycode[2 << 8];	/* index in morse_code of short codes */
+	float dk_s1[DEC_MAXCH];		/* filter state */
+	float dk_s2[DEC_MAXCH];
+	struct dec_chan dk_ch[DEC_MAXCH];
 };
 
 int diagmode;
-double overallwpm = 20.0;
-double charwpm = 20.0;
-struct a_sound dit, dah, inChar, inWord, quietBlock;
-struct play_head playhead, pl_freelist;
-
-int build_dit(struct a_sound *, struct s_params *);
-int build_dah(struct a_sound *, struct s_params *);
-int build_snd(struct a_sound *, struct s_params *, double);
-int build_silence(struct a_sound *, struct s_params *);
-int build_inChar(struct a_sound *, struct s_params *);
-int build_inWord(struct a_sound *, struct s_params *);
-int build_quiet(struct a_sound *, struct s_params *);
-
-void playlist_init(void);
-void playlist_destroy(void);
-void playlist_enqueue(struct play_list *);
-void pl_free(struct play_list *);
-struct play_list *pl_alloc(void);
-int enqueue_sound(struct a_sound *, u_int);
-void init_sounds(void);
+volatile sig_atomic_t stats_asked;	/* SIGUSR1 (or SIGINFO) seen */
+int stats_wakefd = -1;			/* ... and how to say so */
+atomic_ulong xm_count;		/* x_malloc() calls, for the benchmarks */
+const char *sound_bank;		/* directory of sound banks, -K */
+int env_shape = ENV_EXP;	/* tone edges, -E */
+float env_ms = -1.0;		/* ... and their length, if given */
+struct env_tab *env_tabs;	/* all the edges made so far */
+pthread_mutex_t env_lock = PTHREAD_MUTEX_INITIALIZER;
+struct mp_stats *lock_stats;	/* -l: lock sounds as made, counting here */
+
+int build_dit(struct a_sound *, struct sound_set *);
+int build_dah(struct a_sound *, struct sound_set *);
+int build_snd(struct a_sound *, struct sound_set *, double);
+int build_snd_ref(struct a_sound *, struct sound_set *, double);
+int build_env(struct sound_set *);
+struct env_tab *env_table(int, u_int, u_int);
+int build_tone(struct sound_set *);
+void render_tone(struct sound_set *, void *, u_int, u_int, const float *);
+void snd_single(struct a_sound *, const void *);
+int snd_addseg(struct a_sound *, const void *, u_int);
+void snd_flatten(const struct a_sound *, void *, u_int);
+void synth_tone(float *, u_int, double, double);
+void mul_samples(float *, const float *, u_int);
+void put_samples(void *, int, const float *, u_int);
+void get_samples(float *, int, const u_char *, u_int);
+int build_silence(struct a_sound *, struct sound_set *);
+int build_gap(struct a_sound *, struct sound_set *);
+int build_quiet(struct a_sound *, struct sound_set *);
+void sound_lens(struct sound_set *);
+size_t sound_size(struct sound_set *);
+size_t sample_size(struct sound_set *);
+void *ss_alloc(struct sound_set *, size_t);
+void *ss_samples(struct sound_set *, size_t);
+void ss_freearena(struct sound_set *);
+void bank_key(struct sound_set *, struct bank_key *);
+int bank_open(struct sound_set *, char *, size_t);
+int bank_save(struct sound_set *, int, const char *);
+void bank_unmap(struct sound_set *);
+u_int elem_len(struct sound_set *, double);
+
+void playlist_init(struct play_head *);
+void playlist_destroy(struct play_head *);
+u_int playlist_nsamps(struct play_head *);
+u_int playlist_nent(struct play_head *);
+int enqueue_sound(struct play_head *, struct a_sound *, u_int);
+void init_sounds(struct sound_set *, u_int, int, u_int, double, double,
+    float);
 void destroy_sound(struct a_sound *);
-void destroy_sounds(void);
-int build_sounds(struct s_params *);
-void play_string(const char *);
-void convert_char(unsigned char, struct s_params *);
-int fetch_chars(int, struct s_params *);
+void destroy_sounds(struct sound_set *);
+int build_elements(struct sound_set *);
+int build_sounds(struct sound_set *);
+int build_charsnd(struct sound_set *, struct a_sound *, u_int);
+int build_charsnds(struct sound_set *);
+void destroy_charsnds(struct sound_set *);
+struct engine *engine_create(void);
+int engine_configure(struct engine *, u_int, int, u_int, double, double,
+    float);
+void engine_share(struct engine *, struct sound_set *);
+void engine_offer(struct engine *, struct sound_set *);
+void engine_swap(struct engine *);
+void engine_reclaim(struct engine *);
+struct sound_set *make_sounds(u_int, int, u_int, double, double, float);
+void free_sounds(struct sound_set *);
+size_t engine_text(struct engine *, const u_char *, size_t, u_int);
+void engine_render(struct engine *, void *, u_int, u_int, const float *);
+void engine_destroy(struct engine *);
+void engine_timeline(struct engine *, struct timeline *);
+void engine_render_tl(struct engine *, u_char *, u_int, u_int,
+    const float *);
+void render_seg(const struct a_seg *, u_int, u_char *, u_int, u_int, u_int,
+    const float *);
+void tl_index(struct timeline *, struct sound_set *, const u_char *,
+    size_t);
+u_int64_t tl_where(struct timeline *, u_int64_t);
+u_int64_t tl_text(struct timeline *, size_t);
+void ctl_rates(struct s_params *, u_int, u_int, int, float);
+void ctl_seek(struct s_params *, u_int, u_int, int, char *);
+size_t tl_compile(struct sound_set *, const u_char *, size_t,
+    struct tl_ent *, u_int *, u_int, u_int, struct tl_state *);
+int tl_decode(struct tl_state *, u_int);
+void load_table(const char *);
+int mac_cmp(const void *, const void *);
+void cp_hash(void);
+int cp_find(u_int);
+int mac_find(const char *, u_int);
+void tl_gap(struct tl_ent *, u_int *, u_int);
+struct a_sound *tl_sound(struct sound_set *, u_int);
+void tl_build(struct timeline *, struct sound_set *, const u_char *,
+    size_t);
+void tl_write(struct timeline *, struct sound_set *, struct out_file *);
+void tl_free(struct timeline *);
+void of_setlen(struct out_file *, u_int64_t);
+void in_open(struct in_buf *, int, size_t);
+void in_close(struct in_buf *);
+int in_pending(struct in_buf *);
+int fetch_chars(struct in_buf *, struct engine *, u_int);
 int feed_audio(struct s_params *);
 int mp_callback(const void *inputBuffer, void *outputBuffer,
 		unsigned long framesPerBuffer,
 		const PaStreamCallbackTimeInfo *timeInfo,
 		PaStreamCallbackFlags statusFlags, void *userData);
+void render_block(struct s_params *, void *, u_int, u_int64_t);
+void rq_init(struct s_params *, u_int, u_int);
+void rq_free(struct render_q *);
+int rq_fill(struct s_params *);
+void *rq_main(void *);
+void rq_stop(struct s_params *);
+void rq_play(struct s_params *, u_char *, size_t);
+void mono_to_stereo(float *, const float *, u_int);
+void mix_stereo(float *, const float *, u_int, const float *);
+void copy_frames(void *, const void *, u_int, u_int, u_int);
+void mix_out(void *, int, u_int, float *, u_int);
+int dec_main(const char *, u_int, int, int, u_int, float, float, float);
+int dec_audio(u_int, u_int, float, float, float);
+void dec_init(struct decoder *, u_int, u_int, float, float, float);
+void dec_feed(struct decoder *, const float *, u_int);
+void goertzel(float *, float *, const float *, u_int, u_int, float);
+void dec_block(struct decoder *, u_int, float);
+void dec_mark(struct decoder *, struct dec_chan *, u_int);
+void dec_char(struct decoder *, u_int);
+void dec_put(struct decoder *, u_int, const char *);
+void dec_flush(struct decoder *, u_int);
+void dec_end(struct decoder *);
+int wav_read(int, int *, u_int *, u_int *, u_int64_t *);
+int read_all(int, void *, size_t);
+int voice_parse(struct voice *, char *, float, float, float);
 int main_loop(struct s_params *);
-void time_check(struct s_params *);
-void test_times(struct s_params *);
+void wake_main(struct s_params *);
+u_int64_t mono_ns(void);
+void stats_init(struct mp_stats *);
+void stats_callback(struct s_params *, PaStreamCallbackFlags, u_int64_t);
+void stats_latency(struct mp_stats *, u_int64_t);
+void stats_min(atomic_uint *, u_int);
+void stats_max(atomic_uint *, u_int);
+void stats_report(struct s_params *);
+void stats_sig(int);
+void mem_lock(const void *, size_t);
+void ss_lock(struct sound_set *);
+int rt_thread(int, int);
+void rt_error(struct mp_stats *, int);
+void rt_init(struct s_params *);
+void rt_check(struct s_params *);
+void *ctl_main(void *);
+void ctl_cleanup(void *);
+void ctl_command(struct s_params *, char *);
+int file_loop(struct s_params *, int);
+void drain_playlist(struct engine *, struct out_file *);
+void of_open(struct out_file *, int, int, int, u_int);
+void of_put(struct out_file *, const struct a_sound *, u_int, u_int);
+void of_flush(struct out_file *);
+void of_close(struct out_file *);
+void of_wavhdr(u_char *, int, u_int, u_int64_t);
+void of_write(int, struct iovec *, int);
+float time_check(struct sound_set *, float *, int);
+u_long test_times(u_int, float, u_int, int);
+void *times_worker(void *);
+void synth_check(struct s_params *);
+double bench_now(void);
+int bench_main(struct s_params *, const char *);
+void bench_sounds(u_int);
+void bench_callback(u_int);
+void bench_fill(struct engine *);
+void bench_fetch(u_int, const char *);
 int getfloat(const char *, float *);
-void check_chars(void);
+int getnum(const char *, long, long, long *);
+int pick_rates(float *, float *);
+int batch_main(const char *, u_int, int, int, u_int, size_t, float, float,
+    float);
+int batch_parse(struct batch *, FILE *, float, float, float);
+void *batch_worker(void *);
+int batch_render(struct batch_job *, struct batch *);
+void build_lut(void);
+int server_main(const char *, int, int, u_int, size_t, float, float, float);
+int sv_listen(const char *, int);
+void sv_accept(struct server *);
+void sv_feed(struct server *);
+void sv_render(struct server *);
+void sv_send(struct server *, struct sv_client *);
+void sv_drop(struct server *, struct sv_client *, const char *);
 
 #define	x_malloc(x)	xx_malloc((x), __FILE__, __LINE__)
 #define	x_free(x)	xx_free((x), __FILE__, __LINE__)
@@ -135,6 +820,7 @@ xx_malloc(size_t sz, const char *fname, const int lineno)
 	m = malloc(sz);
 	if (m == NULL)
 		err(1, "malloc(%s:%d:%ld", fname, lineno, (long)sz);
+	atomic_fetch_add_explicit(&xm_count, 1, memory_order_relaxed);
 	if (diagmode > 2)
 		printf("M:%p:%lu:%s:%d\n", m, (unsigned long)sz,
 		    fname, lineno);
@@ -150,492 +836,4560 @@ xx_free(void *m, const char *fname, const int lineno)
 }
 
 void
-playlist_init(void)
-{
-	STAILQ_INIT(&playhead.l);
-	STAILQ_INIT(&pl_freelist.l);
-	playhead.nent = 0;
-	playhead.nsamps = 0;
-}
-
-void
-playlist_destroy(void)
+playlist_init(struct play_head *ph)
 {
-	struct play_list *e;
-
-	while (!STAILQ_EMPTY(&playhead.l)) {
-		e = STAILQ_FIRST(&playhead.l);
-		STAILQ_REMOVE_HEAD(&playhead.l, pl_nxt);
-		pl_free(e);
-	}
-	while (!STAILQ_EMPTY(&pl_freelist.l)) {
-		e = STAILQ_FIRST(&pl_freelist.l);
-		STAILQ_REMOVE_HEAD(&pl_freelist.l, pl_nxt);
-		x_free(e);
-	}
+	atomic_init(&ph->ph_head, 0);
+	atomic_init(&ph->ph_tail, 0);
+	atomic_init(&ph->ph_queued, 0);
+	atomic_init(&ph->ph_played, 0);
+	ph->ph_stamp = 0;
 }
 
 void
-playlist_enqueue(struct play_list *e)
+playlist_destroy(struct play_head *ph)
 {
-	STAILQ_INSERT_TAIL(&playhead.l, e, pl_nxt);
-	playhead.nent++;
-	playhead.nsamps += e->pl_snd->len;
+	/* the stream is stopped; just forget whatever is still queued */
+	atomic_store(&ph->ph_head, atomic_load(&ph->ph_tail));
+	atomic_store(&ph->ph_played, atomic_load(&ph->ph_queued));
 }
 
-struct play_list *
-pl_alloc(void)
+/*
+ * Samples queued but not yet played.  Both counters wrap, the difference
+ * does not.
+ */
+u_int
+playlist_nsamps(struct play_head *ph)
 {
-	struct play_list *e;
-
-	if (STAILQ_EMPTY(&pl_freelist.l)) {
-		e = x_malloc(sizeof(*e));
-		if (e == NULL)
-			return (NULL);
-		STAILQ_INSERT_TAIL(&pl_freelist.l, e, pl_nxt);
-	}
-	e = STAILQ_FIRST(&pl_freelist.l);
-	STAILQ_REMOVE_HEAD(&pl_freelist.l, pl_nxt);
-	return (e);
+	return (atomic_load_explicit(&ph->ph_queued, memory_order_relaxed) -
+	    atomic_load_explicit(&ph->ph_played, memory_order_relaxed));
 }
 
-void
-pl_free(struct play_list *e)
+u_int
+playlist_nent(struct play_head *ph)
 {
-	STAILQ_INSERT_TAIL(&pl_freelist.l, e, pl_nxt);
+	return (atomic_load_explicit(&ph->ph_tail, memory_order_relaxed) -
+	    atomic_load_explicit(&ph->ph_head, memory_order_relaxed));
 }
 
+/*
+ * Producer side only.  The slot is filled in before the new tail is
+ * published, so the consumer never sees a partial entry.
+ */
 int
-enqueue_sound(struct a_sound *snd, u_int len)
+enqueue_sound(struct play_head *ph, struct a_sound *snd, u_int len)
 {
 	struct play_list *e;
+	u_int tail;
 
-	e = pl_alloc();
-	if (e == NULL)
-		return (-1);
+	if (len == 0)
+		return (0);
+	tail = atomic_load_explicit(&ph->ph_tail, memory_order_relaxed);
+	while (tail - atomic_load_explicit(&ph->ph_head,
+	    memory_order_acquire) == PL_RINGSIZE) {
+		/* ring is full, wait for the callback to drain some */
+		usleep(1000);
+	}
+	e = &ph->ph_ring[tail & (PL_RINGSIZE - 1)];
 	e->pl_snd = snd;
-	e->pl_ptr = snd->buf;
+	e->pl_seg = 0;
+	e->pl_off = 0;
 	e->pl_res = len;
-	playlist_enqueue(e);
+	e->pl_time = ph->ph_stamp;
+	atomic_store_explicit(&ph->ph_tail, tail + 1, memory_order_release);
+	atomic_fetch_add_explicit(&ph->ph_queued, len, memory_order_relaxed);
 	return (0);
 }
 
+/*
+ * The code of a character is packed into a u_int: the number of elements
+ * above bit 16, and the elements one to a bit from the lowest, 1 for a
+ * dah.  MORSE() packs the built in table when this is compiled, from a
+ * list of DIT and DAH, and fails to compile given anything else or more
+ * than eight of them; tables loaded with -u may use up to MC_MAXEL.
+ */
+#define	DIT		0
+#define	DAH		1
+#define	MC_LEN(m)	((m) >> 16)
+#define	MC_ISDAH(m, i)	(((m) >> (i)) & 1)
+
+#define	MORSE(...)	MC_PACK(MC_COUNT(__VA_ARGS__), __VA_ARGS__,	\
+			    0, 0, 0, 0, 0, 0, 0, 0)
+#define	MC_COUNT(...)	MC_COUNT_(__VA_ARGS__, 16, 15, 14, 13, 12, 11,	\
+			    10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define	MC_COUNT_(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, q, ...) q
+#define	MC_PACK(n, a, b, c, d, e, f, g, h, ...)				\
+	(MC_CHECK((n) <= 8 &&						\
+	    ((a) | (b) | (c) | (d) | (e) | (f) | (g) | (h)) <= 1) +	\
+	    ((n) << 16 | (a) | (b) << 1 | (c) << 2 | (d) << 3 |		\
+	    (e) << 4 | (f) << 5 | (g) << 6 | (h) << 7))
+#define	MC_CHECK(e)	(sizeof(struct { int mc_bad : (e) ? 1 : -1; }) * 0)
+
 const struct morse_char {
 	unsigned char c;
-	char *m;
-} morse_chars[] = {
-	{ 'a', ".-" },
-	{ 'b', "-..." },
-	{ 'c', "-.-." },
-	{ 'd', "-.." },
-	{ 'e', "." },
-	{ 'f', "..-." },
-	{ 'g', "--." },
-	{ 'h', "...." },
-	{ 'i', ".." },
-	{ 'j', ".---" },
-	{ 'k', "-.-" },
-	{ 'l', ".-.." },
-	{ 'm', "--" },
-	{ 'n', "-." },
-	{ 'o', "---" },
-	{ 'p', ".--." },
-	{ 'q', "--.-" },
-	{ 'r', ".-." },
-	{ 's', "..." },
-	{ 't', "-" },
-	{ 'u', "..-" },
-	{ 'v', "...-" },
-	{ 'w', ".--" },
-	{ 'x', "-..-" },
-	{ 'y', "-.--" },
-	{ 'z', "--.." },
-	{ '0', "-----" },
-	{ '1', ".----" },
-	{ '2', "..---" },
-	{ '3', "...--" },
-	{ '4', "....-" },
-	{ '5', "....." },
-	{ '6', "-...." },
-	{ '7', "--..." },
-	{ '8', "---.." },
-	{ '9', "----." },
-	{ '/', "-..-." },
-	{ '?', "..--.." },
-	{ ',', "--..--" },
-	{ '.', ".-.-.-" },
-	{ '*', "...-.-" },	/* SK */
-	{ '+', ".-.-." },	/* AR */
-	{ '=', "-...-" },	/* BT */
-	{ '|', ".-..." },	/* AS */
-	{ '\0', NULL },
+	u_int m;			/* MORSE() */
+} morse_chars[NMORSE + 1] = {
+	{ 'a', MORSE(DIT, DAH) },
+	{ 'b', MORSE(DAH, DIT, DIT, DIT) },
+	{ 'c', MORSE(DAH, DIT, DAH, DIT) },
+	{ 'd', MORSE(DAH, DIT, DIT) },
+	{ 'e', MORSE(DIT) },
+	{ 'f', MORSE(DIT, DIT, DAH, DIT) },
+	{ 'g', MORSE(DAH, DAH, DIT) },
+	{ 'h', MORSE(DIT, DIT, DIT, DIT) },
+	{ 'i', MORSE(DIT, DIT) },
+	{ 'j', MORSE(DIT, DAH, DAH, DAH) },
+	{ 'k', MORSE(DAH, DIT, DAH) },
+	{ 'l', MORSE(DIT, DAH, DIT, DIT) },
+	{ 'm', MORSE(DAH, DAH) },
+	{ 'n', MORSE(DAH, DIT) },
+	{ 'o', MORSE(DAH, DAH, DAH) },
+	{ 'p', MORSE(DIT, DAH, DAH, DIT) },
+	{ 'q', MORSE(DAH, DAH, DIT, DAH) },
+	{ 'r', MORSE(DIT, DAH, DIT) },
+	{ 's', MORSE(DIT, DIT, DIT) },
+	{ 't', MORSE(DAH) },
+	{ 'u', MORSE(DIT, DIT, DAH) },
+	{ 'v', MORSE(DIT, DIT, DIT, DAH) },
+	{ 'w', MORSE(DIT, DAH, DAH) },
+	{ 'x', MORSE(DAH, DIT, DIT, DAH) },
+	{ 'y', MORSE(DAH, DIT, DAH, DAH) },
+	{ 'z', MORSE(DAH, DAH, DIT, DIT) },
+	{ '0', MORSE(DAH, DAH, DAH, DAH, DAH) },
+	{ '1', MORSE(DIT, DAH, DAH, DAH, DAH) },
+	{ '2', MORSE(DIT, DIT, DAH, DAH, DAH) },
+	{ '3', MORSE(DIT, DIT, DIT, DAH, DAH) },
+	{ '4', MORSE(DIT, DIT, DIT, DIT, DAH) },
+	{ '5', MORSE(DIT, DIT, DIT, DIT, DIT) },
+	{ '6', MORSE(DAH, DIT, DIT, DIT, DIT) },
+	{ '7', MORSE(DAH, DAH, DIT, DIT, DIT) },
+	{ '8', MORSE(DAH, DAH, DAH, DIT, DIT) },
+	{ '9', MORSE(DAH, DAH, DAH, DAH, DIT) },
+	{ '/', MORSE(DAH, DIT, DIT, DAH, DIT) },
+	{ '?', MORSE(DIT, DIT, DAH, DAH, DIT, DIT) },
+	{ ',', MORSE(DAH, DAH, DIT, DIT, DAH, DAH) },
+	{ '.', MORSE(DIT, DAH, DIT, DAH, DIT, DAH) },
+	{ '*', MORSE(DIT, DIT, DIT, DAH, DIT, DAH) },	/* SK */
+	{ '+', MORSE(DIT, DAH, DIT, DAH, DIT) },	/* AR */
+	{ '=', MORSE(DAH, DIT, DIT, DIT, DAH) },	/* BT */
+	{ '|', MORSE(DIT, DAH, DIT, DIT, DIT) },	/* AS */
+	{ '\0', 0 },
 };
+_Static_assert(sizeof(morse_chars) / sizeof(morse_chars[0]) == NMORSE + 1,
+    "NMORSE does not match morse_chars");
 
-void
-check_chars(void)
+/*
+ * The code table: the code of every character a sound set has a sound
+ * for, morse_chars and then whatever -u adds.  Each input byte looks up
+ * morse_lut, which for ASCII says all there is to say; the rest of a
+ * UTF-8 character is decoded and its code point found through a perfect
+ * hash (one probe, built by cp_hash()), and a <macro> by name.
+ */
+#define	LUT_NONE	(-1)		/* not in the table: ignored */
+#define	LUT_SPACE	(-2)		/* white space */
+#define	LUT_SLOW	(-3)		/* see tl_decode() */
+#define	LUT_MORE	(-4)		/* ... which needs more bytes */
+
+u_int morse_code[MT_MAX];
+char morse_name[MT_MAX][MAC_MAX + 3];	/* what the decoder prints */
+u_int nmorse;
+short morse_lut[UCHAR_MAX + 1];	/* byte -> index in morse_code, LUT_* */
+
+struct cp_ent {
+	u_int ce_cp;			/* code point, 0 for none */
+	u_int ce_snd;			/* index in morse_code */
+};
+struct cp_ent *morse_cps;		/* as loaded, then the hash */
+u_int nmorse_cp;
+u_int cph_bits, cph_mul;		/* slot is cp * cph_mul >> 32 - bits */
+
+struct mac_ent {
+	char me_name[MAC_MAX + 1];	/* upper case */
+	u_int me_snd;
+};
+struct mac_ent *morse_macs;		/* sorted by name */
+u_int nmorse_mac;
+
+/*
+ * Put together the whole of a character (its dits and dahs, without the
+ * trailing interCharacter space) so that it can be queued as a single
+ * entry.  No samples are copied: the character is the segments of its
+ * elements, one after the other.
+ */
+int
+build_charsnd(struct sound_set *ss, struct a_sound *snd, u_int code)
 {
-	const struct morse_char *mc = morse_chars;
-	const char *p;
+	struct a_sound *els[2] = { &ss->ss_dit, &ss->ss_dah }, *el;
+	u_int nseg = 0, n = MC_LEN(code), e, i;
 
-	for (mc = morse_chars; mc->c != '\0'; mc++) {
-		for (p = mc->m; *p != '\0'; p++) {
-			if (*p == '.' || *p == '-')
-				continue;
-			fprintf(stderr, "invalid char 0x%02x in %c\n",
-			    *p, mc->c);
-			break;
-		}
+	for (e = 0; e < n; e++)
+		nseg += els[MC_ISDAH(code, e)]->nseg;
+	snd->len = 0;
+	snd->flags = SND_ARENA;
+	snd->buf = NULL;
+	snd->nseg = 0;
+	snd->seg = ss_alloc(ss, nseg * sizeof(*snd->seg));
+	if (snd->seg == NULL)
+		return (-1);
+	for (e = 0; e < n; e++) {
+		el = els[MC_ISDAH(code, e)];
+		for (i = 0; i < el->nseg; i++)
+			snd->seg[snd->nseg++] = el->seg[i];
+		snd->len += el->len;
 	}
+	return (0);
 }
 
-void
-play_string(const char *str)
+int
+build_charsnds(struct sound_set *ss)
 {
-	const char *p;
+	u_int i;
 
-	for (p = str; *p; p++) {
-		switch (*p) {
-		case '.':
-			enqueue_sound(&dit, dit.len);
-			break;
-		case '-':
-			enqueue_sound(&dah, dah.len);
-			break;
-		default:
-			errx(1, "invalid character %c in mtable", *p);
+	ss->ss_chars = ss_alloc(ss, nmorse * sizeof(*ss->ss_chars));
+	if (ss->ss_chars == NULL)
+		return (-1);
+	memset(ss->ss_chars, 0, nmorse * sizeof(*ss->ss_chars));
+	for (i = 0; i < nmorse; i++) {
+		if (build_charsnd(ss, &ss->ss_chars[i],
+		    morse_code[i]) != 0) {
+			destroy_charsnds(ss);
+			return (-1);
 		}
 	}
-	enqueue_sound(&inChar, inChar.len);
+	return (0);
 }
 
 void
-convert_char(unsigned char c, struct s_params *pars)
+destroy_charsnds(struct sound_set *ss)
 {
-	int i;
+	u_int i;
 
-	if (c < 0x80 && isupper(c))
-		c = tolower(c);
-	for (i = 0; morse_chars[i].c; i++) {
-		if (morse_chars[i].c == c) {
-			play_string(morse_chars[i].m);
-			return;
-		}
-	}
+	if (ss->ss_chars == NULL)
+		return;
+	for (i = 0; i < nmorse; i++)
+		destroy_sound(&ss->ss_chars[i]);
+	ss->ss_chars = NULL;
 }
 
-int
-fetch_chars(int fd, struct s_params *pars)
+/*
+ * Start the code table off with morse_chars; every byte not in it is an
+ * ASCII character that is ignored, white space, or the start of a UTF-8
+ * sequence.
+ */
+void
+build_lut(void)
 {
-	unsigned char c[64];
-	ssize_t r, i;
+	u_int i;
 
-	r = read(fd, c, sizeof(c));
-	if (r == -1)
-		err(1, "read");
-	if (r == 0)
-		return (1);
-	for (i = 0; i < r; i++) {
-		if (c[i] >= 0x80 || !isspace(c[i])) {
-			convert_char(c[i], pars);
-			pars->sp_seenspace = 0;
-		} else if (pars->sp_seenspace == 0) {
-			enqueue_sound(&inWord, inWord.len);
-			pars->sp_seenspace = 1;
-		}
+	for (i = 0; i <= UCHAR_MAX; i++) {
+		if (i >= 0x80)
+			morse_lut[i] = LUT_SLOW;
+		else if (isspace(i))
+			morse_lut[i] = LUT_SPACE;
+		else
+			morse_lut[i] = LUT_NONE;
 	}
-	return (0);
+	for (i = 0; i < NMORSE; i++) {
+		morse_code[i] = morse_chars[i].m;
+		morse_name[i][0] = morse_chars[i].c;
+		morse_lut[morse_chars[i].c] = i;
+		if (islower(morse_chars[i].c))
+			morse_lut[toupper(morse_chars[i].c)] = i;
+	}
+	nmorse = NMORSE;
 }
 
-int
-main_loop(struct s_params *pars)
+/*
+ * Add the characters of a code table file to the code table.  Each line
+ * is one or more characters (in UTF-8) or a <macro> name, then the code
+ * they all have in dots and dashes.  Codes already in the table share
+ * its sound; the decoder prints the first character of the last line
+ * with the code.
+ */
+void
+load_table(const char *file)
 {
-	struct pollfd fds[2];
-	int iseof = 0;
-
-	fds[0].fd = -1;
-	fds[0].events = POLLOUT;
-	fds[1].events = POLLIN;
+	FILE *f;
+	char *line = NULL, *p, *fld[3];
+	size_t linesz = 0, i, j, n;
+	u_int lineno = 0, code, snd, maxcp = 0, cp = 0, need;
+	u_char *k;
+	struct mac_ent *me;
 
-	for (;;) {
-		if (playhead.nsamps < pars->sp_sampthresh && !iseof)
-			fds[1].fd = fileno(stdin);
-		else
-			fds[1].fd = -1;
+	if ((f = fopen(file, "r")) == NULL)
+		err(1, "%s", file);
+	while (getline(&line, &linesz, f) != -1) {
+		lineno++;
+		for (p = line, n = 0; n < 3 &&
+		    (fld[n] = strsep(&p, " \t\r\n")) != NULL;) {
+			if (*fld[n] != '\0')
+				n++;
+		}
+		if (n == 0 || fld[0][0] == '#')
+			continue;
+		if (n != 2 || (p != NULL && p[strspn(p, " \t\r\n")] != '\0'))
+			errx(1, "%s: line %u: expected characters code", file,
+			    lineno);
 
-		if (poll(fds, sizeof(fds)/sizeof(fds[0]), 1000) == -1)
-			err(1, "poll");
+		n = strlen(fld[1]);
+		if (n == 0 || n > MC_MAXEL || fld[1][strspn(fld[1], ".-")])
+			errx(1, "%s: line %u: invalid code %s (up to %d . "
+			    "and -)", file, lineno, fld[1], MC_MAXEL);
+		for (code = n << 16, i = 0; i < n; i++)
+			if (fld[1][i] == '-')
+				code |= 1 << i;
+		for (snd = 0; snd < nmorse && morse_code[snd] != code; snd++)
+			;
+		if (snd == nmorse) {
+			if (nmorse == MT_MAX)
+				errx(1, "%s: line %u: more than %d codes",
+				    file, lineno, MT_MAX);
+			morse_code[nmorse++] = code;
+		}
 
-		if (fds[1].revents & POLLIN) {
-			/* go grab some data from stdin and queue it */
-			if (fetch_chars(fds[1].fd, pars))
-				break;
+		k = (u_char *)fld[0];
+		n = strlen(fld[0]);
+		if (k[0] == '<' && n > 2 && k[n - 1] == '>') {
+			if (n - 2 > MAC_MAX)
+				errx(1, "%s: line %u: macro name longer than "
+				    "%d", file, lineno, MAC_MAX);
+			me = morse_macs = realloc(morse_macs,
+			    (nmorse_mac + 1) * sizeof(*morse_macs));
+			if (me == NULL)
+				err(1, "realloc");
+			me += nmorse_mac++;
+			for (i = 0; i < n - 2; i++) {
+				if (k[i + 1] >= 0x80 || !isalnum(k[i + 1]))
+					errx(1, "%s: line %u: macro names are "
+					    "letters and digits", file, lineno);
+				me->me_name[i] = toupper(k[i + 1]);
+			}
+			me->me_name[i] = '\0';
+			me->me_snd = snd;
+			snprintf(morse_name[snd], sizeof(morse_name[snd]),
+			    "<%s>", me->me_name);
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			if (i == 0) {
+				for (j = 1; j < n && j < 4 &&
+				    (k[j] & 0xc0) == 0x80; j++)
+					;
+				memcpy(morse_name[snd], k, j);
+				morse_name[snd][j] = '\0';
+			}
+			if (k[i] < 0x80) {
+				morse_lut[k[i]] = snd;
+				if (islower(k[i]))
+					morse_lut[toupper(k[i])] = snd;
+				continue;
+			}
+			if (k[i] >= 0xc2 && k[i] <= 0xdf)
+				cp = k[i] & 0x1f, need = 1;
+			else if (k[i] >= 0xe0 && k[i] <= 0xef)
+				cp = k[i] & 0x0f, need = 2;
+			else if (k[i] >= 0xf0 && k[i] <= 0xf4)
+				cp = k[i] & 0x07, need = 3;
+			else
+				need = 4;
+			for (; need > 0 && need < 4 && i + 1 < n &&
+			    (k[i + 1] & 0xc0) == 0x80; need--)
+				cp = cp << 6 | (k[++i] & 0x3f);
+			if (need > 0 || cp < 0x80)
+				errx(1, "%s: line %u: invalid UTF-8", file,
+				    lineno);
+			if (nmorse_cp == maxcp) {
+				maxcp = maxcp ? maxcp * 2 : 64;
+				if ((morse_cps = realloc(morse_cps,
+				    maxcp * sizeof(*morse_cps))) == NULL)
+					err(1, "realloc");
+			}
+			morse_cps[nmorse_cp].ce_cp = cp;
+			morse_cps[nmorse_cp++].ce_snd = snd;
 		}
 	}
+	free(line);
+	if (ferror(f))
+		err(1, "%s", file);
+	fclose(f);
 
-	return (0);
+	if (nmorse_mac > 0) {
+		qsort(morse_macs, nmorse_mac, sizeof(*morse_macs), mac_cmp);
+		morse_lut['<'] = LUT_SLOW;
+	}
+	cp_hash();
 }
 
 int
-build_inChar(struct a_sound *snd, struct s_params *pars)
+mac_cmp(const void *a, const void *b)
 {
-	float samplen, charu;
-	u_int dit_samps;
+	return (strcmp(((const struct mac_ent *)a)->me_name,
+	    ((const struct mac_ent *)b)->me_name));
+}
 
-	if (overallwpm >= charwpm) {
-		float u;
+/*
+ * Turn the code points loaded into a perfect hash: find a table size and
+ * multiplier that give each its own slot.  The later of two lines with
+ * the same character wins.
+ */
+void
+cp_hash(void)
+{
+	struct cp_ent *ht;
+	u_int bits, try, i, j, h, mul = 0;
 
-		u = 1.2 / overallwpm;
-		samplen = 3.0 * u * (float)pars->sp_rate;
-	} else {
-		float Ta, Tc;
+	/* drop duplicates, keeping the last */
+	for (i = j = 0; i < nmorse_cp; i++) {
+		for (h = 0; h < j; h++)
+			if (morse_cps[h].ce_cp == morse_cps[i].ce_cp)
+				break;
+		morse_cps[h] = morse_cps[i];
+		if (h == j)
+			j++;
+	}
+	nmorse_cp = j;
+	if (nmorse_cp == 0)
+		return;
 
-		Ta = ((60.0 * charwpm) - (37.2 * overallwpm)) /
-		    (charwpm * overallwpm);
-		Tc = (3.0 * Ta) / 19.0;
-		samplen = Tc * (float)pars->sp_rate;
+	for (bits = 1; (1U << bits) < 2 * nmorse_cp; bits++)
+		;
+	ht = NULL;
+	for (; bits <= 24; bits++) {
+		ht = realloc(ht, (1U << bits) * sizeof(*ht));
+		if (ht == NULL)
+			err(1, "realloc");
+		for (try = 0; try < 64; try++) {
+			mul = (0x9e3779b1U + try * 0x7f4a7c16U) | 1;
+			memset(ht, 0, (1U << bits) * sizeof(*ht));
+			for (i = 0; i < nmorse_cp; i++) {
+				h = (morse_cps[i].ce_cp * mul) >> (32 - bits);
+				if (ht[h].ce_cp != 0)
+					break;
+				ht[h] = morse_cps[i];
+			}
+			if (i == nmorse_cp)
+				break;
+		}
+		if (try < 64)
+			break;
 	}
-	dit_samps = pars->sp_ditlen;
-	charu = ((float)dit_samps) / 2.0;
-	snd->len = rintf(samplen - charu);
-	pars->sp_inCharlen = snd->len;
-	return (build_silence(snd, pars));
+	if (bits > 24)
+		errx(1, "no perfect hash for the code table");
+	free(morse_cps);
+	morse_cps = ht;
+	cph_bits = bits;
+	cph_mul = mul;
 }
 
+/*
+ * What a whole code point beyond ASCII is: a character of the table,
+ * white space, or nothing.
+ */
 int
-build_inWord(struct a_sound *snd, struct s_params *pars)
+cp_find(u_int cp)
 {
-	float samplen, m;
-	float inCharSamp, ditsamp;
-
-	if (overallwpm >= charwpm) {
-		float u;
+	const struct cp_ent *ce;
 
-		u = 1.2 / overallwpm;
-		samplen = 7.0 * u * (float)pars->sp_rate;
-	} else {
-		float Ta, Tc;
-
-		Ta = ((60.0 * charwpm) - (37.2 * overallwpm)) /
-		    (charwpm * overallwpm);
-		Tc = (7.0 * Ta) / 19.0;
-		samplen = Tc * (float)pars->sp_rate;
+	switch (cp) {
+	case 0x85: case 0xa0: case 0x1680: case 0x2028: case 0x2029:
+	case 0x202f: case 0x205f: case 0x3000:
+		return (LUT_SPACE);
 	}
-	ditsamp = (float)pars->sp_ditlen / 2.0;
-	inCharSamp = pars->sp_inCharlen;
-	m = inCharSamp + ditsamp;
-	snd->len = (u_int)rintf(samplen - m);
-	return (build_silence(snd, pars));
+	if (cp >= 0x2000 && cp <= 0x200a)
+		return (LUT_SPACE);
+	if (cph_bits == 0 || cp < 0x80)
+		return (LUT_NONE);
+	ce = &morse_cps[(cp * cph_mul) >> (32 - cph_bits)];
+	return (ce->ce_cp == cp ? (int)ce->ce_snd : LUT_NONE);
 }
 
 int
-build_quiet(struct a_sound *snd, struct s_params *pars)
+mac_find(const char *name, u_int len)
 {
-	snd->len = pars->sp_blocksize;
-	return (build_silence(snd, pars));
+	struct mac_ent key, *me;
+
+	memcpy(key.me_name, name, len);
+	key.me_name[len] = '\0';
+	me = bsearch(&key, morse_macs, nmorse_mac, sizeof(*morse_macs),
+	    mac_cmp);
+	return (me != NULL ? (int)me->me_snd : LUT_NONE);
 }
 
+/*
+ * The slow path of tl_compile(), a byte at a time, for whatever
+ * morse_lut cannot settle alone: bytes of a UTF-8 sequence, which may be
+ * split between reads, and of a <macro>.  Returns what morse_lut would
+ * for a whole character, or LUT_MORE until there is one.  Broken
+ * sequences, and macros that are not, are dropped.
+ */
 int
-build_dit(struct a_sound *snd, struct s_params *pars)
+tl_decode(struct tl_state *ts, u_int b)
 {
-	int r;
-
-	r = build_snd(snd, pars, 1.0);
-	if (r != 0)
-		return (r);
-	pars->sp_ditlen = snd->len;
-	return (r);
+	if (ts->ts_inmac) {
+		if (b == '>') {
+			ts->ts_inmac = 0;
+			return (mac_find(ts->ts_mac, ts->ts_nmac));
+		}
+		if (b < 0x80 && isalnum(b) && ts->ts_nmac < MAC_MAX) {
+			ts->ts_mac[ts->ts_nmac++] = toupper(b);
+			return (LUT_MORE);
+		}
+		ts->ts_inmac = 0;	/* and start again at b */
+	}
+	if (ts->ts_need > 0) {
+		if ((b & 0xc0) == 0x80) {
+			ts->ts_cp = ts->ts_cp << 6 | (b & 0x3f);
+			if (--ts->ts_need > 0)
+				return (LUT_MORE);
+			return (cp_find(ts->ts_cp));
+		}
+		ts->ts_need = 0;	/* cut short */
+	}
+	if (b < 0x80) {
+		if (b == '<' && nmorse_mac > 0) {
+			ts->ts_inmac = 1;
+			ts->ts_nmac = 0;
+			return (LUT_MORE);
+		}
+		return (morse_lut[b]);
+	}
+	if (b >= 0xc2 && b <= 0xdf) {
+		ts->ts_cp = b & 0x1f;
+		ts->ts_need = 1;
+	} else if (b >= 0xe0 && b <= 0xef) {
+		ts->ts_cp = b & 0x0f;
+		ts->ts_need = 2;
+	} else if (b >= 0xf0 && b <= 0xf4) {
+		ts->ts_cp = b & 0x07;
+		ts->ts_need = 3;
+	} else
+		return (LUT_NONE);
+	return (LUT_MORE);
 }
 
-int
-build_dah(struct a_sound *snd, struct s_params *pars)
+/*
+ * Compile up to len bytes of text onto the timeline te, which already
+ * has *ntep of its maxte entries used, stopping early once budget
+ * samples have been added or te is (nearly) full.  Each character is
+ * followed by its interCharacter space; runs of white space are one
+ * interWord space.  Returns the number of bytes used; ts carries over
+ * whatever the next call needs to carry on from there.
+ */
+size_t
+tl_compile(struct sound_set *ss, const u_char *c, size_t len,
+    struct tl_ent *te, u_int *ntep, u_int maxte, u_int budget,
+    struct tl_state *ts)
 {
-	int r;
+	u_int nte = *ntep;
+	u_int64_t samps = 0;
+	size_t i;
+	int m, busy = ts->ts_need > 0 || ts->ts_inmac;
 
-	r = build_snd(snd, pars, 3.0);
-	if (r != 0)
-		return (r);
-	pars->sp_dahlen = snd->len;
-	return (r);
+	for (i = 0; i < len && samps < budget; i++) {
+		if (nte + 2 > maxte)
+			break;
+		if (busy || (m = morse_lut[c[i]]) == LUT_SLOW) {
+			m = tl_decode(ts, c[i]);
+			busy = ts->ts_need > 0 || ts->ts_inmac;
+		}
+		if (m >= 0) {
+			ts->ts_space = 0;
+			te[nte].te_snd = m;
+			te[nte++].te_len = ss->ss_chars[m].len;
+			tl_gap(te, &nte, ss->ss_inCharlen);
+			samps += ss->ss_chars[m].len + ss->ss_inCharlen;
+		} else if (m == LUT_SPACE) {
+			if (ts->ts_space == 0) {
+				tl_gap(te, &nte, ss->ss_inWordlen);
+				samps += ss->ss_inWordlen;
+				ts->ts_space = 1;
+			}
+		} else if (m == LUT_NONE)
+			ts->ts_space = 0;
+	}
+	*ntep = nte;
+	return (i);
 }
 
-int
-build_snd(struct a_sound *snd, struct s_params *pars, double units)
+/*
+ * Add len samples of silence to the end of te, onto the gap already
+ * there if there is one.
+ */
+void
+tl_gap(struct tl_ent *te, u_int *ntep, u_int len)
 {
-	u_int i, attack1, attack2, attack3, nsamps, idx;
-	float u, m;
+	if (len == 0)
+		return;
+	if (*ntep > 0 && te[*ntep - 1].te_snd == TL_GAP)
+		te[*ntep - 1].te_len += len;
+	else {
+		te[*ntep].te_snd = TL_GAP;
+		te[(*ntep)++].te_len = len;
+	}
+}
 
-	u = 1.2 / charwpm;
-	nsamps = rintf((units + 1.0) * u * (float)pars->sp_rate);
-	snd->len = nsamps;
-	snd->buf = (float *)x_malloc(snd->len * sizeof(float));
-	if (snd->buf == NULL)
-		return (-1);
-	attack2 = (u_int)rintf(units * u * (float)pars->sp_rate);
+struct a_sound *
+tl_sound(struct sound_set *ss, u_int snd)
+{
+	return (snd == TL_GAP ? &ss->ss_gap : &ss->ss_chars[snd]);
+}
 
-	u = (1.2 / charwpm) * 0.2;
+/*
+ * Compile all of the text into tl.  There is nothing to seek by until
+ * tl_index() is called.
+ */
+void
+tl_build(struct timeline *tl, struct sound_set *ss, const u_char *c,
+    size_t len)
+{
+	struct tl_ent *te;
+	struct tl_state ts;
+	size_t i, used;
+	u_int n;
 
-	if (u > 0.006)
-		u = 0.006;
+	memset(&ts, 0, sizeof(ts));
+	tl->tl_start = NULL;
+	tl->tl_toff = NULL;
+	tl->tl_para = NULL;
+	tl->tl_npara = 0;
+	tl->tl_n = 0;
+	tl->tl_size = 1024;
+	tl->tl_ent = x_malloc(tl->tl_size * sizeof(*tl->tl_ent));
+	while (len > 0) {
+		if (tl->tl_size - tl->tl_n < 2) {
+			te = x_malloc(2 * tl->tl_size * sizeof(*te));
+			memcpy(te, tl->tl_ent, tl->tl_n * sizeof(*te));
+			x_free(tl->tl_ent);
+			tl->tl_ent = te;
+			tl->tl_size *= 2;
+		}
+		n = tl->tl_n;
+		used = tl_compile(ss, c, len, tl->tl_ent, &n,
+		    tl->tl_size > UINT_MAX ? UINT_MAX : tl->tl_size, UINT_MAX,
+		    &ts);
+		tl->tl_n = n;
+		c += used;
+		len -= used;
+	}
+	for (tl->tl_samps = 0, i = 0; i < tl->tl_n; i++)
+		tl->tl_samps += tl->tl_ent[i].te_len;
+}
 
-	u *= (float)pars->sp_rate;
-	attack1 = (u_int)u;
-	attack3 = attack1 + attack2;
+void
+tl_write(struct timeline *tl, struct sound_set *ss, struct out_file *of)
+{
+	size_t i;
 
+	for (i = 0; i < tl->tl_n; i++)
+		of_put(of, tl_sound(ss, tl->tl_ent[i].te_snd), 0,
+		    tl->tl_ent[i].te_len);
+}
 
-	for (i = 0, idx = 0; i < nsamps; i++) {
-		float t = (float)i / (float)pars->sp_rate;
+void
+tl_free(struct timeline *tl)
+{
+	x_free(tl->tl_ent);
+	if (tl->tl_start != NULL) {
+		x_free(tl->tl_start);
+		x_free(tl->tl_toff);
+		x_free(tl->tl_para);
+	}
+	tl->tl_ent = NULL;
+	tl->tl_start = NULL;
+	tl->tl_toff = tl->tl_para = NULL;
+	tl->tl_n = tl->tl_size = tl->tl_npara = 0;
+}
 
-		if (i < attack1) {
-			float T = (double)attack1 / (double)pars->sp_rate;
-			float RC = T / 5.0;
+/*
+ * Prefix sums for seeking in tl, compiled from the len bytes of text c:
+ * where each entry starts, in samples and in the text (a gap counts as
+ * part of the character after it), and where each paragraph starts.  A
+ * paragraph starts the text and follows every blank line.  The text is
+ * compiled again a byte at a time to see where each character starts.
+ */
+void
+tl_index(struct timeline *tl, struct sound_set *ss, const u_char *c,
+    size_t len)
+{
+	struct tl_ent te[3];
+	struct tl_state ts;
+	size_t i, j, n, bol, npara, start = 0;
+	u_int64_t t;
+	u_int nte;
+	int blank;
 
-			m = 1.0 * (1 - expf(-t / RC));
-			m = 1.0;
-		} else if (i > attack2 && i < attack3) {
-			float T = (double)attack1 / (double)pars->sp_rate;
-			float RC = T / 5.0;
-			float q = (double)(i - attack2) / (double)pars->sp_rate;
+	tl->tl_start = x_malloc((tl->tl_n + 1) * sizeof(*tl->tl_start));
+	tl->tl_toff = x_malloc((tl->tl_n + 1) * sizeof(*tl->tl_toff));
+	for (t = 0, j = 0; j < tl->tl_n; j++) {
+		tl->tl_start[j] = t;
+		t += tl->tl_ent[j].te_len;
+	}
+	tl->tl_start[j] = t;
+	memset(&ts, 0, sizeof(ts));
+	for (i = j = 0; i < len && j < tl->tl_n; i++) {
+		if (ts.ts_need == 0 && !ts.ts_inmac)
+			start = i;
+		nte = 0;
+		tl_compile(ss, c + i, 1, te, &nte, 3, UINT_MAX, &ts);
+		if (nte == 0 || te[0].te_snd == TL_GAP)
+			continue;
+		while (j < tl->tl_n && tl->tl_ent[j].te_snd == TL_GAP)
+			tl->tl_toff[j++] = start;
+		tl->tl_toff[j++] = start;
+	}
+	while (j <= tl->tl_n)
+		tl->tl_toff[j++] = len;
 
-			m = 1.0 * expf(-q / RC);
-		} else if (i >= attack3)
-			m = 0.0;
+	for (n = 2, i = 0; i < len; i++)
+		if (c[i] == '\n')
+			n++;
+	tl->tl_para = x_malloc(n / 2 * sizeof(*tl->tl_para) + sizeof(size_t));
+	tl->tl_para[0] = 0;
+	npara = 1;
+	for (blank = 0, bol = 0, i = 0; i < len; i++) {
+		if (c[i] != '\n')
+			continue;
+		for (j = bol; j < i && isspace(c[j]); j++)
+			;
+		if (j == i && bol > 0)
+			blank = 1;
+		else if (blank) {
+			tl->tl_para[npara++] = bol;
+			blank = 0;
+		}
+		bol = i + 1;
+	}
+	if (blank && bol < len)
+		tl->tl_para[npara++] = bol;
+	tl->tl_npara = npara;
+}
+
+/*
+ * Where sample pos of tl is, packed for e_seek: the entry it is in and
+ * the offset into that.
+ */
+u_int64_t
+tl_where(struct timeline *tl, u_int64_t pos)
+{
+	size_t lo = 0, hi = tl->tl_n, mid;
+
+	if (pos >= tl->tl_samps)
+		return ((u_int64_t)tl->tl_n << 32);
+	/* the last entry starting at or before pos */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (tl->tl_start[mid] <= pos)
+			lo = mid;
 		else
-			m = 1.0;
+			hi = mid;
+	}
+	return ((u_int64_t)lo << 32 | (pos - tl->tl_start[lo]));
+}
+
+/*
+ * The first sample played for byte off of the text, or later.
+ */
+u_int64_t
+tl_text(struct timeline *tl, size_t off)
+{
+	size_t lo = 0, hi = tl->tl_n, mid;
+
+	/* the first entry from off on */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tl->tl_toff[mid] < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (tl->tl_start[lo]);
+}
+
+void
+in_open(struct in_buf *ib, int fd, size_t max)
+{
+	struct stat st;
+
+	ib->ib_fd = fd;
+	ib->ib_off = ib->ib_len = 0;
+	ib->ib_max = max;
+	ib->ib_mapped = 0;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    (off_t)(size_t)st.st_size == st.st_size) {
+		ib->ib_buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		    fd, 0);
+		if (ib->ib_buf != MAP_FAILED) {
+			madvise(ib->ib_buf, st.st_size, MADV_SEQUENTIAL);
+			ib->ib_size = ib->ib_len = st.st_size;
+			ib->ib_mapped = 1;
+			return;
+		}
+	}
+	ib->ib_size = max < IN_MINBUF ? max : IN_MINBUF;
+	ib->ib_buf = x_malloc(ib->ib_size);
+}
+
+void
+in_close(struct in_buf *ib)
+{
+	if (ib->ib_mapped)
+		munmap(ib->ib_buf, ib->ib_size);
+	else
+		x_free(ib->ib_buf);
+	ib->ib_buf = NULL;
+}
+
+/*
+ * Is there text left that needs no read() to get at?
+ */
+int
+in_pending(struct in_buf *ib)
+{
+	return (ib->ib_mapped || ib->ib_off < ib->ib_len);
+}
 
-		snd->buf[idx] = m * sinf(t * 2.0f * M_PI * pars->sp_hz);
-		idx++;
+/*
+ * Queue text from ib until about budget samples have been queued, reading
+ * more only once everything buffered has been queued.  Returns 1 at end
+ * of input.
+ */
+int
+fetch_chars(struct in_buf *ib, struct engine *eng, u_int budget)
+{
+	ssize_t r;
+
+	if (ib->ib_off == ib->ib_len) {
+		if (ib->ib_mapped)
+			return (1);
+		if (ib->ib_len == ib->ib_size && ib->ib_size < ib->ib_max) {
+			/* the last read filled the buffer, try a bigger one */
+			ib->ib_size *= 2;
+			if (ib->ib_size > ib->ib_max)
+				ib->ib_size = ib->ib_max;
+			x_free(ib->ib_buf);
+			ib->ib_buf = x_malloc(ib->ib_size);
+		}
+		ib->ib_off = ib->ib_len = 0;
+		r = read(ib->ib_fd, ib->ib_buf, ib->ib_size);
+		if (r == -1)
+			err(1, "read");
+		if (r == 0)
+			return (1);
+		ib->ib_len = r;
+		eng->e_ph.ph_stamp = mono_ns();
+	} else if (ib->ib_mapped) {
+		/* read as it is queued, as far as anyone can tell */
+		eng->e_ph.ph_stamp = mono_ns();
 	}
+	ib->ib_off += engine_text(eng, ib->ib_buf + ib->ib_off,
+	    ib->ib_len - ib->ib_off, budget);
 	return (0);
 }
 
+struct engine *
+engine_create(void)
+{
+	struct engine *eng;
+
+	eng = x_malloc(sizeof(*eng));
+	eng->e_ss = NULL;
+	eng->e_own = NULL;
+	atomic_init(&eng->e_next, NULL);
+	eng->e_retired = NULL;
+	eng->e_bps = 0;
+	eng->e_rate = 0;
+	eng->e_stats = NULL;
+	eng->e_dac = 0;
+	atomic_init(&eng->e_paused, 0);
+	eng->e_tl = NULL;
+	eng->e_tlent = 0;
+	eng->e_tloff = 0;
+	atomic_init(&eng->e_seek, TL_NOSEEK);
+	atomic_init(&eng->e_pos, 0);
+	memset(&eng->e_ts, 0, sizeof(eng->e_ts));
+	playlist_init(&eng->e_ph);
+	return (eng);
+}
+
+/*
+ * (Re)build the engine's own sounds.  Nothing may be queued from the old
+ * ones.
+ */
 int
-build_silence(struct a_sound *snd, struct s_params *pars)
+engine_configure(struct engine *eng, u_int rate, int fmt, u_int blocksize,
+    double owpm, double cwpm, float hz)
 {
-	snd->buf = x_malloc(snd->len);
-	if (snd->buf == NULL)
+	struct sound_set *ss;
+
+	if ((ss = make_sounds(rate, fmt, blocksize, owpm, cwpm, hz)) == NULL)
 		return (-1);
-	memset(snd->buf, '\0', snd->len);
+	free_sounds(eng->e_own);
+	eng->e_ss = eng->e_own = ss;
+	eng->e_bps = ss->ss_bps;
+	eng->e_rate = ss->ss_rate;
 	return (0);
 }
 
+/*
+ * Play from a sound set owned by someone else (and outliving the engine).
+ */
 void
-init_sounds(void)
+engine_share(struct engine *eng, struct sound_set *ss)
 {
-	dit.len = 0; dit.buf = NULL;
-	dah.len = 0; dah.buf = NULL;
-	inChar.len = 0; inChar.buf = NULL;
-	inWord.len = 0; inWord.buf = NULL;
-	quietBlock.len = 0; quietBlock.buf = NULL;
+	free_sounds(eng->e_own);
+	eng->e_own = NULL;
+	eng->e_ss = ss;
+	eng->e_bps = ss->ss_bps;
+	eng->e_rate = ss->ss_rate;
 }
 
+/*
+ * From any thread: have the engine change over to ss, which must be in
+ * the same format as its current sounds, at the next character.  The
+ * engine takes ownership; a set offered earlier and not yet taken up is
+ * superseded and freed.
+ */
 void
-destroy_sound(struct a_sound *snd)
+engine_offer(struct engine *eng, struct sound_set *ss)
 {
-	snd->len = 0;
-	if (snd->buf != NULL) {
-		x_free(snd->buf);
-		snd->buf = NULL;
+	free_sounds(atomic_exchange_explicit(&eng->e_next, ss,
+	    memory_order_acq_rel));
+}
+
+/*
+ * Producer side: change over to an offered set, if there is one.  The
+ * old set is retired rather than freed, tagged with the play list slot
+ * its last sound went into.
+ */
+void
+engine_swap(struct engine *eng)
+{
+	struct sound_set *ss;
+
+	ss = atomic_exchange_explicit(&eng->e_next, NULL,
+	    memory_order_acquire);
+	if (ss == NULL)
+		return;
+	if (eng->e_own != NULL) {
+		eng->e_own->ss_retire = atomic_load_explicit(
+		    &eng->e_ph.ph_tail, memory_order_relaxed);
+		eng->e_own->ss_next = eng->e_retired;
+		eng->e_retired = eng->e_own;
+	}
+	eng->e_ss = eng->e_own = ss;
+}
+
+/*
+ * Producer side: free retired sets the callback has played past.  Once
+ * ph_head reaches a set's ss_retire, every slot that pointed into it has
+ * been handed back.
+ */
+void
+engine_reclaim(struct engine *eng)
+{
+	struct sound_set **ssp, *ss;
+	u_int head;
+
+	if (eng->e_retired == NULL)
+		return;
+	head = atomic_load_explicit(&eng->e_ph.ph_head, memory_order_acquire);
+	for (ssp = &eng->e_retired; (ss = *ssp) != NULL;) {
+		if ((int)(head - ss->ss_retire) >= 0) {
+			*ssp = ss->ss_next;
+			free_sounds(ss);
+		} else
+			ssp = &ss->ss_next;
+	}
+}
+
+/*
+ * Queue the morse for up to len bytes of text, stopping early once budget
+ * samples have been queued or the play list is (nearly) full.  The text
+ * is compiled a timeline chunk at a time, and a new sound set offered to
+ * the engine is taken up between chunks.  Returns the number of bytes
+ * used.
+ */
+size_t
+engine_text(struct engine *eng, const u_char *c, size_t len, u_int budget)
+{
+	struct tl_ent te[TL_CHUNK];
+	u_int queued = 0, slots, n, i;
+	size_t used = 0;
+
+	engine_reclaim(eng);
+	slots = PL_RINGSIZE - playlist_nent(&eng->e_ph);
+	while (used < len && queued < budget && slots >= 2) {
+		if (atomic_load_explicit(&eng->e_next,
+		    memory_order_relaxed) != NULL)
+			engine_swap(eng);
+		n = 0;
+		used += tl_compile(eng->e_ss, c + used, len - used, te, &n,
+		    slots < TL_CHUNK ? slots : TL_CHUNK, budget - queued,
+		    &eng->e_ts);
+		for (i = 0; i < n; i++) {
+			enqueue_sound(&eng->e_ph, tl_sound(eng->e_ss,
+			    te[i].te_snd), te[i].te_len);
+			queued += te[i].te_len;
+		}
+		slots -= n;
+	}
+	return (used);
+}
+
+/*
+ * Consumer side: render frames of chans interleaved channels into out, in
+ * the sound set's format, silence once the queue runs dry.  Copies whole
+ * runs, as much of the head entry as will fit.  With a (left, right) gain
+ * the engine is added to the float stereo already in out instead, and
+ * silence costs nothing; that needs a float sound set.
+ */
+void
+engine_render(struct engine *eng, void *outp, u_int frames, u_int chans,
+    const float *gain)
+{
+	struct play_head *ph = &eng->e_ph;
+	struct play_list *e;
+	const struct a_seg *sg;
+	u_char *out = outp;
+	u_int head, tail, left, n, played = 0;
+	u_int bps = eng->e_bps, fsz;
+
+	fsz = gain != NULL ? 2 * sizeof(float) : chans * bps;
+	if (atomic_load_explicit(&eng->e_paused, memory_order_relaxed)) {
+		if (gain == NULL)
+			memset(out, 0, frames * fsz);
+		return;
+	}
+	if (eng->e_tl != NULL) {
+		engine_render_tl(eng, out, frames, chans, gain);
+		return;
+	}
+	head = atomic_load_explicit(&ph->ph_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ph->ph_tail, memory_order_acquire);
+
+	for (left = frames; left > 0; left -= n) {
+		if (head == tail) {
+			/* nothing queued, play silence */
+			if (gain == NULL)
+				memset(out, 0, left * fsz);
+			break;
+		}
+
+		e = &ph->ph_ring[head & (PL_RINGSIZE - 1)];
+		if (eng->e_stats != NULL && e->pl_seg == 0 &&
+		    e->pl_off == 0 && !(e->pl_snd->flags & SND_SILENT))
+			stats_latency(eng->e_stats, eng->e_dac +
+			    (u_int64_t)(frames - left) * 1000000000 /
+			    eng->e_rate - e->pl_time);
+		sg = &e->pl_snd->seg[e->pl_seg];
+		n = sg->sg_len - e->pl_off;
+		if (n > e->pl_res)
+			n = e->pl_res;
+		if (n > left)
+			n = left;
+		render_seg(sg, e->pl_off, out, n, bps, chans, gain);
+		out += n * fsz;
+		e->pl_off += n;
+		e->pl_res -= n;
+		played += n;
+		if (e->pl_off == sg->sg_len) {
+			e->pl_seg++;
+			e->pl_off = 0;
+		}
+		if (e->pl_res == 0) {
+			head++;
+			atomic_store_explicit(&ph->ph_head, head,
+			    memory_order_release);
+		}
+	}
+	atomic_fetch_add_explicit(&ph->ph_played, played,
+	    memory_order_relaxed);
+}
+
+/*
+ * n samples of sg from off into out, as for engine_render().
+ */
+void
+render_seg(const struct a_seg *sg, u_int off, u_char *out, u_int n,
+    u_int bps, u_int chans, const float *gain)
+{
+	if (gain != NULL) {
+		if (sg->sg_buf != NULL)
+			mix_stereo((float *)out,
+			    (const float *)sg->sg_buf + off, n, gain);
+	} else if (sg->sg_buf == NULL)
+		memset(out, 0, n * chans * bps);
+	else
+		copy_frames(out, (const u_char *)sg->sg_buf + off * bps, n,
+		    bps, chans);
+}
+
+/*
+ * engine_render() from the engine's timeline, going first to wherever
+ * e_seek says.
+ */
+void
+engine_render_tl(struct engine *eng, u_char *out, u_int frames, u_int chans,
+    const float *gain)
+{
+	struct timeline *tl = eng->e_tl;
+	struct play_head *ph = &eng->e_ph;
+	const struct a_sound *snd;
+	const struct a_seg *sg;
+	u_int left, n, off, fsz, bps = eng->e_bps;
+	u_int64_t seek, pos;
+
+	seek = atomic_exchange_explicit(&eng->e_seek, TL_NOSEEK,
+	    memory_order_acquire);
+	if (seek != TL_NOSEEK) {
+		eng->e_tlent = seek >> 32;
+		eng->e_tloff = seek & 0xffffffff;
+	}
+	fsz = gain != NULL ? 2 * sizeof(float) : chans * bps;
+
+	for (left = frames; left > 0; left -= n) {
+		if (eng->e_tlent == tl->tl_n) {
+			if (gain == NULL)
+				memset(out, 0, left * fsz);
+			break;
+		}
+		snd = tl_sound(eng->e_ss, tl->tl_ent[eng->e_tlent].te_snd);
+		for (sg = snd->seg, off = eng->e_tloff; off >= sg->sg_len;
+		    sg++)
+			off -= sg->sg_len;
+		n = sg->sg_len - off;
+		if (n > tl->tl_ent[eng->e_tlent].te_len - eng->e_tloff)
+			n = tl->tl_ent[eng->e_tlent].te_len - eng->e_tloff;
+		if (n > left)
+			n = left;
+		render_seg(sg, off, out, n, bps, chans, gain);
+		out += n * fsz;
+		if ((eng->e_tloff += n) == tl->tl_ent[eng->e_tlent].te_len) {
+			eng->e_tlent++;
+			eng->e_tloff = 0;
+		}
+	}
+
+	pos = eng->e_tlent == tl->tl_n ? tl->tl_samps :
+	    tl->tl_start[eng->e_tlent] + eng->e_tloff;
+	atomic_store_explicit(&eng->e_pos, pos, memory_order_relaxed);
+	/* what is left, as far as main_loop and the statistics can tell */
+	pos = tl->tl_samps - pos;
+	atomic_store_explicit(&ph->ph_played,
+	    atomic_load_explicit(&ph->ph_queued, memory_order_relaxed) -
+	    (pos > UINT_MAX ? UINT_MAX : (u_int)pos), memory_order_relaxed);
+}
+
+/*
+ * Have eng play tl, which was compiled against its sound set and
+ * indexed, from the start.  Before the stream starts.
+ */
+void
+engine_timeline(struct engine *eng, struct timeline *tl)
+{
+	eng->e_tl = tl;
+	eng->e_tlent = 0;
+	eng->e_tloff = 0;
+	atomic_store(&eng->e_seek, TL_NOSEEK);
+	atomic_store(&eng->e_pos, 0);
+	atomic_store(&eng->e_ph.ph_played, atomic_load(&eng->e_ph.ph_queued) -
+	    (tl->tl_samps > UINT_MAX ? UINT_MAX : (u_int)tl->tl_samps));
+}
+
+/*
+ * The engine must no longer be rendering.
+ */
+void
+engine_destroy(struct engine *eng)
+{
+	struct sound_set *ss;
+
+	playlist_destroy(&eng->e_ph);
+	free_sounds(eng->e_own);
+	free_sounds(atomic_load(&eng->e_next));
+	while ((ss = eng->e_retired) != NULL) {
+		eng->e_retired = ss->ss_next;
+		free_sounds(ss);
+	}
+	x_free(eng);
+}
+
+/*
+ * Keep every voice queued up to sp_sampthresh.  A voice that is full (or
+ * finished and still playing) is left alone until the callback reports,
+ * through sp_wakefd, that it has drained to its v_wakeat; fds[0] is the
+ * read side of that pipe.  Returns once all input has been played.
+ */
+int
+main_loop(struct s_params *pars)
+{
+	struct pollfd fds[1 + MAXVOICES];
+	struct voice *v;
+	u_int i, nfds, live, nsamps;
+	int timeout;
+	char junk[64];
+
+	fds[0].fd = pars->sp_wakefd[0];
+	fds[0].events = POLLIN;
+	nfds = 1 + pars->sp_nvoices;
+	for (i = 1; i < nfds; i++)
+		fds[i].events = POLLIN;
+
+	for (;;) {
+		live = 0;
+		timeout = -1;
+		for (i = 0; i < pars->sp_nvoices; i++) {
+			v = &pars->sp_voices[i];
+			fds[1 + i].fd = -1;
+			nsamps = playlist_nsamps(&v->v_eng->e_ph);
+			if (v->v_eof) {
+				/* wait for the last of it to be played */
+				if (nsamps > 0) {
+					live++;
+					v->v_wakeat = 0;
+					atomic_store_explicit(&v->v_wait, 1,
+					    memory_order_release);
+				}
+				continue;
+			}
+			live++;
+			if (nsamps >= pars->sp_sampthresh) {
+				v->v_wakeat = pars->sp_lowat;
+				atomic_store_explicit(&v->v_wait, 1,
+				    memory_order_release);
+				continue;
+			}
+			if (in_pending(&v->v_in)) {
+				/* queue what is already buffered */
+				if (fetch_chars(&v->v_in, v->v_eng,
+				    pars->sp_sampthresh - nsamps))
+					v->v_eof = 1;
+				timeout = 0;
+			} else
+				fds[1 + i].fd = v->v_fd;
+		}
+		if (live == 0)
+			break;
+
+		if (pars->sp_rt)
+			rt_check(pars);
+		if (stats_asked) {
+			stats_asked = 0;
+			stats_report(pars);
+		}
+		if (pars->sp_statint > 0.0) {
+			u_int64_t now = mono_ns();
+			int ms;
+
+			if (now >= pars->sp_statnext) {
+				stats_report(pars);
+				pars->sp_statnext = now +
+				    pars->sp_statint * 1e9;
+			}
+			ms = (pars->sp_statnext - now) / 1000000 + 1;
+			if (timeout == -1 || ms < timeout)
+				timeout = ms;
+		}
+
+		/*
+		 * Don't sleep through a wakeup the callback decided against
+		 * before v_wait was set.
+		 */
+		for (i = 0; i < pars->sp_nvoices; i++) {
+			v = &pars->sp_voices[i];
+			if (atomic_load(&v->v_wait) &&
+			    playlist_nsamps(&v->v_eng->e_ph) <= v->v_wakeat)
+				timeout = 0;
+		}
+
+		if (poll(fds, nfds, timeout) == -1 && errno != EINTR)
+			err(1, "poll");
+
+		for (i = 0; i < pars->sp_nvoices; i++)
+			atomic_store(&pars->sp_voices[i].v_wait, 0);
+		if (fds[0].revents & POLLIN)
+			while (read(fds[0].fd, junk, sizeof(junk)) > 0)
+				;
+
+		for (i = 0; i < pars->sp_nvoices; i++) {
+			v = &pars->sp_voices[i];
+			if (fds[1 + i].fd != -1 &&
+			    (fds[1 + i].revents & (POLLIN | POLLHUP))) {
+				/* go grab some text and queue it */
+				nsamps = playlist_nsamps(&v->v_eng->e_ph);
+				if (fetch_chars(&v->v_in, v->v_eng,
+				    pars->sp_sampthresh - nsamps))
+					v->v_eof = 1;
+			}
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Called from the audio callback: poke main_loop if it is waiting for a
+ * voice that has now drained far enough.  The pipe is non-blocking, and
+ * v_wait makes it at most one byte per wait.
+ */
+void
+wake_main(struct s_params *pars)
+{
+	struct voice *v;
+	u_int i;
+
+	for (i = 0; i < pars->sp_nvoices; i++) {
+		v = &pars->sp_voices[i];
+		if (atomic_load_explicit(&v->v_wait, memory_order_acquire) &&
+		    playlist_nsamps(&v->v_eng->e_ph) <= v->v_wakeat &&
+		    atomic_exchange(&v->v_wait, 0)) {
+			(void)write(pars->sp_wakefd[1], "", 1);
+			return;
+		}
+	}
+}
+
+u_int64_t
+mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+void
+stats_init(struct mp_stats *ms)
+{
+	u_int i;
+
+	atomic_init(&ms->ms_calls, 0);
+	atomic_init(&ms->ms_underflow, 0);
+	atomic_init(&ms->ms_overflow, 0);
+	atomic_init(&ms->ms_starved, 0);
+	for (i = 0; i < CB_NHIST; i++)
+		atomic_init(&ms->ms_hist[i], 0);
+	atomic_init(&ms->ms_cbmax, 0);
+	atomic_init(&ms->ms_qmin, UINT_MAX);
+	atomic_init(&ms->ms_qmax, 0);
+	atomic_init(&ms->ms_emin, UINT_MAX);
+	atomic_init(&ms->ms_emax, 0);
+	atomic_init(&ms->ms_nlat, 0);
+	atomic_init(&ms->ms_latsum, 0);
+	atomic_init(&ms->ms_latmax, 0);
+	atomic_init(&ms->ms_locked, 0);
+	atomic_init(&ms->ms_lockerr, 0);
+	atomic_init(&ms->ms_lockerrno, 0);
+	atomic_init(&ms->ms_rterr, 0);
+	atomic_init(&ms->ms_rterrno, 0);
+}
+
+/*
+ * The callback's only writer, so plain loads and stores will do; a
+ * reset by stats_report() in between just loses one sample.
+ */
+void
+stats_min(atomic_uint *a, u_int v)
+{
+	if (v < atomic_load_explicit(a, memory_order_relaxed))
+		atomic_store_explicit(a, v, memory_order_relaxed);
+}
+
+void
+stats_max(atomic_uint *a, u_int v)
+{
+	if (v > atomic_load_explicit(a, memory_order_relaxed))
+		atomic_store_explicit(a, v, memory_order_relaxed);
+}
+
+/*
+ * From engine_render(): a character that will be heard ns after its
+ * text was read.
+ */
+void
+stats_latency(struct mp_stats *ms, u_int64_t ns)
+{
+	atomic_fetch_add_explicit(&ms->ms_nlat, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&ms->ms_latsum, ns, memory_order_relaxed);
+	if (ns > atomic_load_explicit(&ms->ms_latmax, memory_order_relaxed))
+		atomic_store_explicit(&ms->ms_latmax, ns,
+		    memory_order_relaxed);
+}
+
+/*
+ * End of a callback that started at t0: count its flags and time, and
+ * note how deep the shallowest voice's queue is.
+ */
+void
+stats_callback(struct s_params *pars, PaStreamCallbackFlags flags,
+    u_int64_t t0)
+{
+	struct mp_stats *ms = &pars->sp_stats;
+	struct play_head *ph;
+	u_int i, q, qmin = UINT_MAX, emin = UINT_MAX;
+	u_int64_t d;
+
+	if (flags & paOutputUnderflow)
+		atomic_fetch_add_explicit(&ms->ms_underflow, 1,
+		    memory_order_relaxed);
+	if (flags & paOutputOverflow)
+		atomic_fetch_add_explicit(&ms->ms_overflow, 1,
+		    memory_order_relaxed);
+	for (i = 0; i < pars->sp_nvoices; i++) {
+		ph = &pars->sp_voices[i].v_eng->e_ph;
+		if ((q = playlist_nsamps(ph)) < qmin)
+			qmin = q;
+		if ((q = playlist_nent(ph)) < emin)
+			emin = q;
 	}
+	stats_min(&ms->ms_qmin, qmin);
+	stats_max(&ms->ms_qmax, qmin);
+	stats_min(&ms->ms_emin, emin);
+	stats_max(&ms->ms_emax, emin);
+
+	d = mono_ns() - t0;
+	for (i = 0; i < CB_NHIST - 1 && d >= (1000U << i); i++)
+		;
+	atomic_fetch_add_explicit(&ms->ms_hist[i], 1, memory_order_relaxed);
+	if (d > atomic_load_explicit(&ms->ms_cbmax, memory_order_relaxed))
+		atomic_store_explicit(&ms->ms_cbmax, d, memory_order_relaxed);
+	atomic_fetch_add_explicit(&ms->ms_calls, 1, memory_order_relaxed);
 }
 
+/*
+ * One line on the standard error: the counts since the stream started,
+ * then the queue depths and latencies since the last report.
+ */
 void
-destroy_sounds(void)
+stats_report(struct s_params *pars)
 {
-	destroy_sound(&dit);
-	destroy_sound(&dah);
-	destroy_sound(&inChar);
-	destroy_sound(&inWord);
-	destroy_sound(&quietBlock);
+	struct mp_stats *ms = &pars->sp_stats;
+	u_long calls, nlat, latsum, latmax;
+	u_int qmin, qmax, emin, emax, i;
+
+	calls = atomic_load(&ms->ms_calls);
+	qmin = atomic_exchange(&ms->ms_qmin, UINT_MAX);
+	qmax = atomic_exchange(&ms->ms_qmax, 0);
+	emin = atomic_exchange(&ms->ms_emin, UINT_MAX);
+	emax = atomic_exchange(&ms->ms_emax, 0);
+	nlat = atomic_exchange(&ms->ms_nlat, 0);
+	latsum = atomic_exchange(&ms->ms_latsum, 0);
+	latmax = atomic_exchange(&ms->ms_latmax, 0);
+	if (calls == pars->sp_statcalls)
+		qmin = qmax = emin = emax = 0;
+	pars->sp_statcalls = calls;
+
+	fprintf(stderr, "stats t=%.1f underflow=%lu overflow=%lu starved=%lu "
+	    "calls=%lu cbmax=%luus hist=", (mono_ns() - pars->sp_stat0) / 1e9,
+	    atomic_load(&ms->ms_underflow), atomic_load(&ms->ms_overflow),
+	    atomic_load(&ms->ms_starved), calls,
+	    atomic_load(&ms->ms_cbmax) / 1000);
+	for (i = 0; i < CB_NHIST; i++)
+		fprintf(stderr, "%s%lu", i ? "," : "",
+		    atomic_load(&ms->ms_hist[i]));
+	fprintf(stderr, " qsamps=%u-%u qents=%u-%u chars=%lu "
+	    "latency=%.1fms latmax=%.1fms", qmin, qmax, emin, emax, nlat,
+	    nlat ? latsum / 1e6 / nlat : 0.0, latmax / 1e6);
+	if (pars->sp_rt)
+		fprintf(stderr, " locked=%luK lockerr=%lu rterr=%lu",
+		    atomic_load(&ms->ms_locked) / 1024,
+		    atomic_load(&ms->ms_lockerr), atomic_load(&ms->ms_rterr));
+	fputc('\n', stderr);
+}
+
+/*
+ * Lock the pages under len bytes at addr into memory for -l, and fault
+ * them in either way.  Nothing is ever unlocked: mlock() is per page
+ * rather than per object, and a freed block goes back to malloc still
+ * resident, which is where the next set of sounds will come from.
+ */
+void
+mem_lock(const void *addr, size_t len)
+{
+	struct mp_stats *ms = lock_stats;
+	size_t pg = (size_t)sysconf(_SC_PAGESIZE);
+	volatile const u_char *p = addr;
+	size_t off, i;
+
+	if (ms == NULL || len == 0)
+		return;
+	off = (u_long)addr & (pg - 1);
+	if (mlock((const u_char *)addr - off, len + off) == 0)
+		atomic_fetch_add(&ms->ms_locked, len + off);
+	else {
+		atomic_store(&ms->ms_lockerrno, errno);
+		atomic_fetch_add(&ms->ms_lockerr, 1);
+	}
+	/* a byte of each page, staying inside the object */
+	for (i = 0; i < len; i += pg - off, off = 0)
+		(void)p[i];
+}
+
+/*
+ * Everything the callback reads in a set of sounds: the set, its arena
+ * and bank, and the edges it shares with others.
+ */
+void
+ss_lock(struct sound_set *ss)
+{
+	struct ar_chunk *ac;
+
+	mem_lock(ss, sizeof(*ss));
+	for (ac = ss->ss_arena; ac != NULL; ac = ac->ac_next)
+		mem_lock(ac, AR_HDR + ac->ac_size);
+	if (ss->ss_bank != NULL)
+		mem_lock(ss->ss_bank, ss->ss_banksize);
+	if (ss->ss_env != NULL)
+		mem_lock(ss->ss_env, (2 * ss->ss_envlen + 1) * sizeof(float));
+}
+
+/*
+ * Move the calling thread to SCHED_FIFO at prio, or at what
+ * RLIMIT_RTPRIO allows if that is less, and onto cpu unless it is -1.
+ * Returns 0 or an errno.
+ */
+int
+rt_thread(int prio, int cpu)
+{
+	struct sched_param sp;
+	int e;
+#ifdef RLIMIT_RTPRIO
+	struct rlimit rl;
+#endif
+
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = prio;
+	e = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+#ifdef RLIMIT_RTPRIO
+	if (e == EPERM && getrlimit(RLIMIT_RTPRIO, &rl) == 0 &&
+	    rl.rlim_cur > 0 && rl.rlim_cur < (rlim_t)prio) {
+		sp.sched_priority = rl.rlim_cur;
+		e = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+	}
+#endif
+	if (e != 0)
+		return (e);
+#if defined(__linux__)
+	if (cpu != -1) {
+		cpu_set_t cs;
+
+		CPU_ZERO(&cs);
+		CPU_SET(cpu, &cs);
+		e = pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+	}
+#endif
+	return (e);
+}
+
+/* what rt_thread() said, for main_loop to report */
+void
+rt_error(struct mp_stats *ms, int e)
+{
+	if (e == 0)
+		return;
+	atomic_store(&ms->ms_rterrno, e);
+	atomic_fetch_add(&ms->ms_rterr, 1);
+}
+
+/*
+ * Before the stream starts: keep the last CPU we may run on for the
+ * callback and move this thread, and so every thread it starts, off it.
+ * With a single CPU there is nothing to split.
+ */
+void
+rt_init(struct s_params *pars)
+{
+	pars->sp_rtcpu = -1;
+#if defined(__linux__)
+	{
+		cpu_set_t cs;
+		int c;
+
+		if (sched_getaffinity(0, sizeof(cs), &cs) != 0) {
+			rt_error(&pars->sp_stats, errno);
+			return;
+		}
+		if (CPU_COUNT(&cs) < 2)
+			return;
+		for (c = CPU_SETSIZE - 1; !CPU_ISSET(c, &cs); c--)
+			;
+		CPU_CLR(c, &cs);
+		rt_error(&pars->sp_stats,
+		    pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs));
+		pars->sp_rtcpu = c;
+	}
+#endif
+}
+
+/*
+ * From main_loop: say so when locking or real-time scheduling has failed
+ * since the last look, rather than carry on quietly without it.
+ */
+void
+rt_check(struct s_params *pars)
+{
+	struct mp_stats *ms = &pars->sp_stats;
+	u_long n;
+
+	if ((n = atomic_load(&ms->ms_lockerr)) != pars->sp_lockerr) {
+		warnx("could not lock sounds into memory: %s",
+		    strerror(atomic_load(&ms->ms_lockerrno)));
+		pars->sp_lockerr = n;
+	}
+	if ((n = atomic_load(&ms->ms_rterr)) != pars->sp_rterr) {
+		warnx("could not make the audio thread real-time: %s",
+		    strerror(atomic_load(&ms->ms_rterrno)));
+		pars->sp_rterr = n;
+	}
+}
+
+/*
+ * SIGUSR1 (and SIGINFO): report at main_loop's next turn, waking it if
+ * need be.
+ */
+void
+stats_sig(int sig)
+{
+	int save = errno;
+
+	stats_asked = 1;
+	if (stats_wakefd != -1)
+		(void)write(stats_wakefd, "", 1);
+	errno = save;
+}
+
+/*
+ * Read rate and pitch changes from the control file, one per line:
+ * "[voice] w wpm", "[voice] c cwpm" or "[voice] f freq", the voice being
+ * counted from 1 in the order given with -m (all of them if left out).
+ * The new sounds are built here, off both the audio and the text paths,
+ * and offered to the engines.  A FIFO is reopened for the next writer.
+ */
+void *
+ctl_main(void *arg)
+{
+	struct s_params *pars = arg;
+	struct ctl_state cs = { NULL, NULL, 0 };
+	struct stat st;
+	int fifo;
+
+	/* main() cancels the thread, most likely asleep in open or read */
+	pthread_cleanup_push(ctl_cleanup, &cs);
+	do {
+		if ((cs.cs_f = fopen(pars->sp_ctl, "r")) == NULL) {
+			warn("%s", pars->sp_ctl);
+			break;
+		}
+		while (getline(&cs.cs_line, &cs.cs_linesz, cs.cs_f) != -1)
+			ctl_command(pars, cs.cs_line);
+		fifo = fstat(fileno(cs.cs_f), &st) == 0 &&
+		    S_ISFIFO(st.st_mode);
+		fclose(cs.cs_f);
+		cs.cs_f = NULL;
+	} while (fifo);
+	pthread_cleanup_pop(1);
+	return (NULL);
+}
+
+void
+ctl_cleanup(void *arg)
+{
+	struct ctl_state *cs = arg;
+
+	if (cs->cs_f != NULL)
+		fclose(cs->cs_f);
+	free(cs->cs_line);
+}
+
+void
+ctl_command(struct s_params *pars, char *line)
+{
+	char *fld[4], *p = line, *ep;
+	u_int nf, first, last;
+	float val = 0.0;
+	long l;
+	int state;
+
+	for (nf = 0; nf < 4 && (fld[nf] = strsep(&p, " \t\r\n")) != NULL;)
+		if (*fld[nf] != '\0')
+			nf++;
+	if (nf == 0 || fld[0][0] == '#')
+		return;
+	first = 0;
+	last = pars->sp_nvoices;
+	if (nf > 1 && fld[0][strspn(fld[0], "0123456789")] == '\0') {
+		if (getnum(fld[0], 1, pars->sp_nvoices, &l)) {
+			warnx("control: no voice %s", fld[0]);
+			return;
+		}
+		first = l - 1;
+		last = l;
+		fld[0] = fld[1];
+		fld[1] = fld[2];
+		fld[2] = fld[3];
+		nf--;
+	}
+	if (nf > 2 || (p != NULL && p[strspn(p, " \t\r\n")] != '\0') ||
+	    strlen(fld[0]) != 1 ||
+	    (nf == 1) != (fld[0][0] == 'p' || fld[0][0] == 'r')) {
+		warnx("control: expected [voice] w|c|f|t|o|P value "
+		    "or [voice] p|r");
+		return;
+	}
+
+	switch (fld[0][0]) {
+	case 'w':
+	case 'c':
+		if (getfloat(fld[1], &val) || val < 1.0 || val > 70.0) {
+			warnx("control: invalid rate %s", fld[1]);
+			return;
+		}
+		break;
+	case 'f':
+		if (getfloat(fld[1], &val) || val < 1.0 || val > 20000.0) {
+			warnx("control: invalid frequency %s", fld[1]);
+			return;
+		}
+		break;
+	case 't':
+		errno = 0;
+		if (!isfinite(strtod(fld[1], &ep)) || *ep != '\0' ||
+		    errno != 0) {
+			warnx("control: invalid time %s", fld[1]);
+			return;
+		}
+		break;
+	case 'o':
+	case 'P':
+		if (getnum(fld[1], fld[0][0] == 'P', LONG_MAX, &l)) {
+			warnx("control: invalid position %s", fld[1]);
+			return;
+		}
+		break;
+	case 'p':
+	case 'r':
+		break;
+	default:
+		warnx("control: unknown command %s", fld[0]);
+		return;
+	}
+
+	/* don't leave a set half built or unoffered */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	switch (fld[0][0]) {
+	case 'w':
+	case 'c':
+	case 'f':
+		ctl_rates(pars, first, last, fld[0][0], val);
+		break;
+	case 'p':
+	case 'r':
+		for (; first < last; first++)
+			atomic_store(&pars->sp_voices[first].v_eng->e_paused,
+			    fld[0][0] == 'p');
+		break;
+	default:
+		ctl_seek(pars, first, last, fld[0][0], fld[1]);
+		break;
+	}
+	pthread_setcancelstate(state, NULL);
+}
+
+/*
+ * New sounds for voices first to last - 1, with rate or pitch (cmd w, c
+ * or f) changed to val, offered to their engines.
+ */
+void
+ctl_rates(struct s_params *pars, u_int first, u_int last, int cmd, float val)
+{
+	struct sound_set *ss;
+	struct voice *v;
+	float o, c, h;
+	u_int i;
+
+	for (i = first; i < last; i++) {
+		v = &pars->sp_voices[i];
+		if (v->v_eng->e_tl != NULL) {
+			warnx("control: voice %u plays a timeline, its rate "
+			    "and pitch are fixed", i + 1);
+			continue;
+		}
+		o = v->v_owpm;
+		c = v->v_cwpm;
+		h = v->v_hz;
+		if (cmd == 'w') {
+			/* as if given with -w */
+			o = val;
+			c = -1.0;
+			pick_rates(&o, &c);
+		} else if (cmd == 'c') {
+			c = val;
+			if (o > c)
+				o = c;
+		} else
+			h = val;
+		if ((ss = make_sounds(pars->sp_rate, v->v_fmt,
+		    pars->sp_blocksize, o, c, h)) == NULL) {
+			warnx("control: unable to build sounds");
+			return;
+		}
+		engine_offer(v->v_eng, ss);
+		v->v_owpm = o;
+		v->v_cwpm = c;
+		v->v_hz = h;
+	}
+}
+
+/*
+ * Send voices first to last - 1 elsewhere in their timelines: to a time
+ * in seconds (cmd t; from where they are if signed), a byte of the text
+ * (o) or the start of a paragraph (P).
+ */
+void
+ctl_seek(struct s_params *pars, u_int first, u_int last, int cmd, char *arg)
+{
+	struct engine *eng;
+	struct timeline *tl;
+	u_int64_t pos;
+	double secs;
+	long l;
+	u_int i;
+
+	for (i = first; i < last; i++) {
+		eng = pars->sp_voices[i].v_eng;
+		if ((tl = eng->e_tl) == NULL) {
+			warnx("control: voice %u cannot seek (see -T)", i + 1);
+			continue;
+		}
+		switch (cmd) {
+		case 't':
+			secs = strtod(arg, NULL) * pars->sp_rate;
+			if (arg[0] == '+' || arg[0] == '-')
+				secs += atomic_load(&eng->e_pos);
+			/* past the end is the end */
+			if (secs <= 0.0)
+				pos = 0;
+			else if (secs >= (double)tl->tl_samps)
+				pos = tl->tl_samps;
+			else
+				pos = (u_int64_t)secs;
+			break;
+		case 'o':
+			l = strtol(arg, NULL, 10);
+			pos = tl_text(tl, l);
+			break;
+		default:
+			l = strtol(arg, NULL, 10);
+			if ((size_t)l > tl->tl_npara) {
+				warnx("control: voice %u has only %zu "
+				    "paragraphs", i + 1, tl->tl_npara);
+				continue;
+			}
+			pos = tl_text(tl, tl->tl_para[l - 1]);
+			break;
+		}
+		atomic_store_explicit(&eng->e_seek, tl_where(tl, pos),
+		    memory_order_release);
+	}
+}
+
+/*
+ * Render fd to pars->sp_out as fast as it can be read: queue as much as
+ * the play list holds, then play the whole queue into the file.
+ */
+int
+file_loop(struct s_params *pars, int fd)
+{
+	struct in_buf ib;
+	struct timeline tl;
+	int iseof;
+
+	in_open(&ib, fd, pars->sp_inbuf);
+	if (ib.ib_mapped) {
+		/*
+		 * All the text is there at once: compile it up front, and
+		 * the length is known before anything is written.
+		 */
+		tl_build(&tl, pars->sp_eng->e_ss, ib.ib_buf, ib.ib_len);
+		if (diagmode > 0)
+			fprintf(stderr, "%zu timeline entries, %llu samples, "
+			    "%.1f s\n", tl.tl_n, (unsigned long long)
+			    tl.tl_samps, (double)tl.tl_samps / pars->sp_rate);
+		of_setlen(pars->sp_out, tl.tl_samps);
+		tl_write(&tl, pars->sp_eng->e_ss, pars->sp_out);
+		tl_free(&tl);
+	} else {
+		do {
+			iseof = fetch_chars(&ib, pars->sp_eng, UINT_MAX);
+			drain_playlist(pars->sp_eng, pars->sp_out);
+		} while (!iseof);
+	}
+	in_close(&ib);
+	return (0);
+}
+
+/*
+ * Consumer side of the play list for file output; runs in the same
+ * thread as the producer.
+ */
+void
+drain_playlist(struct engine *eng, struct out_file *of)
+{
+	struct play_head *ph = &eng->e_ph;
+	struct play_list *e;
+	u_int head, tail, played = 0;
+
+	head = atomic_load_explicit(&ph->ph_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ph->ph_tail, memory_order_acquire);
+	for (; head != tail; head++) {
+		e = &ph->ph_ring[head & (PL_RINGSIZE - 1)];
+		of_put(of, e->pl_snd, e->pl_off, e->pl_res);
+		played += e->pl_res;
+	}
+	atomic_store_explicit(&ph->ph_head, head, memory_order_release);
+	atomic_fetch_add_explicit(&ph->ph_played, played,
+	    memory_order_relaxed);
+}
+
+/* source for silence; a multiple of every sample size */
+const u_char of_zeros[12288];
+
+void
+of_open(struct out_file *of, int fd, int type, int fmt, u_int rate)
+{
+	of->of_fd = fd;
+	of->of_type = type;
+	of->of_fmt = fmt;
+	of->of_bps = sf_bps[fmt];
+	of->of_rate = rate;
+	of->of_frames = 0;
+	of->of_niov = 0;
+	of->of_fill = 0;
+	if (type == OF_WAV) {
+		/*
+		 * Sizes are filled in by of_setlen() if the length is known
+		 * up front, or patched in of_close() if fd is seekable.
+		 */
+		of_wavhdr(of->of_hdr, fmt, rate, 0);
+		of->of_iov[0].iov_base = of->of_hdr;
+		of->of_iov[0].iov_len = sizeof(of->of_hdr);
+		of->of_niov = 1;
+	}
+}
+
+/*
+ * How many frames there are going to be; before anything is flushed.
+ */
+void
+of_setlen(struct out_file *of, u_int64_t frames)
+{
+	if (of->of_type == OF_WAV)
+		of_wavhdr(of->of_hdr, of->of_fmt, of->of_rate, frames);
+}
+
+/*
+ * Append len samples of snd starting at off, a segment at a time.  The
+ * sound buffers stay put until rendering is done, so output just records
+ * where they are.
+ */
+void
+of_put(struct out_file *of, const struct a_sound *snd, u_int off, u_int len)
+{
+	const struct a_seg *sg = snd->seg;
+	struct iovec *iov;
+	u_int n, bps = of->of_bps;
+
+	if (len == 0)
+		return;
+	of->of_frames += len;
+	for (; off >= sg->sg_len; sg++)
+		off -= sg->sg_len;
+	while (len > 0) {
+		if (off == sg->sg_len) {
+			sg++;
+			off = 0;
+		}
+		n = sg->sg_len - off;
+		if (n > len)
+			n = len;
+#if BYTE_ORDER == BIG_ENDIAN
+		if (of->of_fmt != SF_F32) {
+			const u_char *src;
+			u_int i, j, m;
+
+			src = (const u_char *)sg->sg_buf + off * bps;
+			off += n;
+			len -= n;
+			for (; n > 0; n -= m) {
+				if (of->of_fill == OF_BUFLEN)
+					of_flush(of);
+				m = (OF_BUFLEN - of->of_fill) / bps;
+				if (m > n)
+					m = n;
+				if (sg->sg_buf == NULL)
+					memset(of->of_buf + of->of_fill, 0,
+					    m * bps);
+				else {
+					for (i = 0; i < m; i++, src += bps)
+						for (j = 0; j < bps; j++)
+							of->of_buf[of->of_fill
+							    + i * bps + j] =
+							    src[bps - 1 - j];
+				}
+				of->of_fill += m * bps;
+			}
+			continue;
+		}
+#endif
+		if (of->of_niov == OF_NIOV)
+			of_flush(of);
+		iov = &of->of_iov[of->of_niov++];
+		if (sg->sg_buf == NULL) {
+			if (n > sizeof(of_zeros) / bps)
+				n = sizeof(of_zeros) / bps;
+			iov->iov_base = (void *)of_zeros;
+		} else
+			iov->iov_base = (u_char *)sg->sg_buf + off * bps;
+		iov->iov_len = n * bps;
+		off += n;
+		len -= n;
+	}
+}
+
+void
+of_flush(struct out_file *of)
+{
+	if (of->of_niov > 0)
+		of_write(of->of_fd, of->of_iov, of->of_niov);
+	of->of_niov = 0;
+	if (of->of_fill > 0) {
+		of->of_iov[0].iov_base = of->of_buf;
+		of->of_iov[0].iov_len = of->of_fill;
+		of_write(of->of_fd, of->of_iov, 1);
+	}
+	of->of_fill = 0;
+}
+
+void
+of_close(struct out_file *of)
+{
+	u_char hdr[OF_WAVHDR];
+
+	of_flush(of);
+	if (of->of_type == OF_WAV && lseek(of->of_fd, 0, SEEK_SET) == 0) {
+		of_wavhdr(hdr, of->of_fmt, of->of_rate, of->of_frames);
+		of->of_iov[0].iov_base = hdr;
+		of->of_iov[0].iov_len = sizeof(hdr);
+		of_write(of->of_fd, of->of_iov, 1);
+	}
+	if (close(of->of_fd) == -1)
+		err(1, "close");
+}
+
+#define	PUT16(p, v)	do {						\
+	(p)[0] = (v) & 0xff; (p)[1] = ((v) >> 8) & 0xff;		\
+} while (0)
+#define	PUT32(p, v)	do {						\
+	PUT16((p), (v) & 0xffff); PUT16((p) + 2, ((v) >> 16) & 0xffff);	\
+} while (0)
+
+/*
+ * Canonical 44 byte header for frames of mono PCM (or IEEE float).  Until
+ * the length is known (or if it never will be, on a pipe or socket) the
+ * sizes are all ones.
+ */
+void
+of_wavhdr(u_char *hdr, int fmt, u_int rate, u_int64_t frames)
+{
+	u_int bps = sf_bps[fmt];
+	u_int64_t bytes = frames * bps;
+	u_int32_t datalen, riffLen;
+
+	if (frames == 0 || bytes > 0xffffffffULL - OF_WAVHDR) {
+		datalen = 0xffffffff - OF_WAVHDR;
+		riffLen = 0xffffffff - 8;
+	} else {
+		datalen = (u_int32_t)bytes;
+		riffLen = datalen + OF_WAVHDR - 8;
+	}
+	memcpy(hdr, "RIFF", 4);
+	PUT32(hdr + 4, riffLen);
+	memcpy(hdr + 8, "WAVEfmt ", 8);
+	PUT32(hdr + 16, 16);		/* fmt chunk length */
+	PUT16(hdr + 20, fmt == SF_F32 ? 3 : 1);	/* float or PCM */
+	PUT16(hdr + 22, 1);		/* channels */
+	PUT32(hdr + 24, rate);
+	PUT32(hdr + 28, rate * bps);	/* bytes per second */
+	PUT16(hdr + 32, bps);		/* block align */
+	PUT16(hdr + 34, bps * 8);	/* bits per sample */
+	memcpy(hdr + 36, "data", 4);
+	PUT32(hdr + 40, datalen);
+}
+
+/*
+ * writev() the whole vector, picking up after short writes.
+ */
+void
+of_write(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t r;
+
+	while (cnt > 0) {
+		r = writev(fd, iov, cnt);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "write");
+		}
+		while (cnt > 0 && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+}
+
+/*
+ * Work out the length in samples of every element and space from the
+ * rates alone; nothing is built.  The build_* functions take their
+ * lengths from here, and so does the timing check.
+ */
+void
+sound_lens(struct sound_set *ss)
+{
+	float samplen, charu, m, edge;
+	float inCharSamp, ditsamp;
+
+	ss->ss_ditlen = elem_len(ss, 1.0);
+	ss->ss_dahlen = elem_len(ss, 3.0);
+
+	/*
+	 * The falling edge is the first 20% of the element space, at most
+	 * 6ms, unless -E gave a length.  It goes in the element space and a
+	 * rising edge at the start of the element, so neither is ever
+	 * longer than a dit.  The steady tone is long enough for a dah.
+	 */
+	edge = (1.2 / ss->ss_cwpm) * 0.2;
+	if (edge > 0.006)
+		edge = 0.006;
+	if (env_ms >= 0.0)
+		edge = env_ms / 1000.0;
+	ss->ss_envshape = env_shape;
+	ss->ss_envlen = (u_int)(edge * (float)ss->ss_rate);
+	if (ss->ss_envlen > ss->ss_ditlen / 2)
+		ss->ss_envlen = ss->ss_ditlen / 2;
+	ss->ss_tonelen = (u_int)rintf(3.0 * (1.2 / ss->ss_cwpm) *
+	    (float)ss->ss_rate) + 1;
+
+	/* interCharacter */
+	if (ss->ss_owpm >= ss->ss_cwpm) {
+		float u;
+
+		u = 1.2 / ss->ss_owpm;
+		samplen = 3.0 * u * (float)ss->ss_rate;
+	} else {
+		float Ta, Tc;
+
+		Ta = ((60.0 * ss->ss_cwpm) - (37.2 * ss->ss_owpm)) /
+		    (ss->ss_cwpm * ss->ss_owpm);
+		Tc = (3.0 * Ta) / 19.0;
+		samplen = Tc * (float)ss->ss_rate;
+	}
+	charu = ((float)ss->ss_ditlen) / 2.0;
+	ss->ss_inCharlen = rintf(samplen - charu);
+
+	/* interWord */
+	if (ss->ss_owpm >= ss->ss_cwpm) {
+		float u;
+
+		u = 1.2 / ss->ss_owpm;
+		samplen = 7.0 * u * (float)ss->ss_rate;
+	} else {
+		float Ta, Tc;
+
+		Ta = ((60.0 * ss->ss_cwpm) - (37.2 * ss->ss_owpm)) /
+		    (ss->ss_cwpm * ss->ss_owpm);
+		Tc = (7.0 * Ta) / 19.0;
+		samplen = Tc * (float)ss->ss_rate;
+	}
+	ditsamp = (float)ss->ss_ditlen / 2.0;
+	inCharSamp = ss->ss_inCharlen;
+	m = inCharSamp + ditsamp;
+	ss->ss_inWordlen = (u_int)rintf(samplen - m);
+}
+
+/*
+ * Bytes of arena a set with these lengths needs: the steady tone and the
+ * edge of each element (unless they are in a bank),
+ * the segments of the elements, and the sound and segments of every
+ * character.
+ */
+size_t
+sound_size(struct sound_set *ss)
+{
+	size_t sz, nel = 0;
+	u_int i;
+
+	for (i = 0; i < nmorse; i++)
+		nel += MC_LEN(morse_code[i]);
+	sz = ss->ss_bank == NULL ? sample_size(ss) : 0;
+	sz += 2 * AR_ROUND(3 * sizeof(struct a_seg));
+	sz += AR_ROUND(nmorse * sizeof(struct a_sound));
+	sz += nmorse * (AR_ALIGN - 1) + nel * 3 * sizeof(struct a_seg);
+	return (sz);
+}
+
+/*
+ * ... and of that, the samples.
+ */
+size_t
+sample_size(struct sound_set *ss)
+{
+	size_t sz;
+
+	sz = AR_ROUND(ss->ss_tonelen * ss->ss_bps);
+	sz += 2 * AR_ROUND((ss->ss_envlen + 1) * ss->ss_bps);
+	return (sz);
+}
+
+/*
+ * sz bytes from the set's arena, starting it (or chaining on a chunk)
+ * if need be.
+ */
+void *
+ss_alloc(struct sound_set *ss, size_t sz)
+{
+	struct ar_chunk *ac = ss->ss_arena;
+	size_t csz;
+	void *p;
+
+	sz = AR_ROUND(sz);
+	if (ac == NULL || ac->ac_size - ac->ac_used < sz) {
+		csz = sound_size(ss);
+		if (csz < sz)
+			csz = sz;
+		ac = x_malloc(AR_HDR + csz);
+		ac->ac_next = ss->ss_arena;
+		ac->ac_size = csz;
+		ac->ac_used = 0;
+		ss->ss_arena = ac;
+	}
+	p = (u_char *)ac + AR_HDR + ac->ac_used;
+	ac->ac_used += sz;
+	return (p);
+}
+
+/*
+ * sz bytes for samples: the next of the bank if there is one, else from
+ * the arena.  Sets with the same key ask for the same sizes in the same
+ * order, so each gets back the samples the bank was made with.
+ */
+void *
+ss_samples(struct sound_set *ss, size_t sz)
+{
+	void *p;
+
+	if (ss->ss_bank == NULL)
+		return (ss_alloc(ss, sz));
+	sz = AR_ROUND(sz);
+	if (ss->ss_banksize - ss->ss_bankused < sz)
+		errx(1, "sound bank too small");
+	p = ss->ss_bank + ss->ss_bankused;
+	ss->ss_bankused += sz;
+	return (p);
+}
+
+void
+ss_freearena(struct sound_set *ss)
+{
+	struct ar_chunk *ac;
+
+	while ((ac = ss->ss_arena) != NULL) {
+		ss->ss_arena = ac->ac_next;
+		x_free(ac);
+	}
+	bank_unmap(ss);
+}
+
+void
+bank_key(struct sound_set *ss, struct bank_key *bk)
+{
+	memset(bk, 0, sizeof(*bk));	/* and the padding */
+	bk->bk_version = BANK_VERSION;
+	bk->bk_order = BANK_ORDER;
+	bk->bk_rate = ss->ss_rate;
+	bk->bk_fmt = ss->ss_fmt;
+	bk->bk_hz = ss->ss_hz;
+	bk->bk_cwpm = ss->ss_cwpm;
+	bk->bk_env = ss->ss_envshape;
+	bk->bk_envlen = ss->ss_envlen;
+	bk->bk_tonelen = ss->ss_tonelen;
+	bk->bk_ditlen = ss->ss_ditlen;
+	bk->bk_dahlen = ss->ss_dahlen;
+}
+
+/*
+ * Map the set's bank from sound_bank, named for a hash (FNV-1a) of its
+ * key.  If there is a good one the set is banked and none of its
+ * samples need building.  Otherwise a new bank is started as tmp and
+ * its descriptor returned: the samples are then built straight into it
+ * and bank_save() puts it in place.  Returns -1 if there is nothing to
+ * save; on any trouble the set is just built in memory.
+ */
+int
+bank_open(struct sound_set *ss, char *tmp, size_t tmplen)
+{
+	struct bank_key key;
+	struct bank_hdr *bh;
+	struct stat st;
+	const u_char *k;
+	u_int64_t h = 0xcbf29ce484222325ULL;
+	size_t i, sz;
+	void *p;
+	int fd, n;
+
+	bank_key(ss, &key);
+	for (k = (const u_char *)&key, i = 0; i < sizeof(key); i++)
+		h = (h ^ k[i]) * 0x100000001b3ULL;
+	sz = BANK_HDR + sample_size(ss);
+	n = snprintf(tmp, tmplen, "%s/%016llx.bank.XXXXXX", sound_bank,
+	    (unsigned long long)h);
+	if (n < 0 || (size_t)n >= tmplen) {
+		warnx("%s: name too long", sound_bank);
+		return (-1);
+	}
+	tmp[n - 7] = '\0';
+	if ((fd = open(tmp, O_RDONLY)) != -1) {
+		p = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && st.st_size == (off_t)sz)
+			p = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p != MAP_FAILED) {
+			bh = p;
+			if (memcmp(bh->bh_magic, BANK_MAGIC, 8) == 0 &&
+			    memcmp(&bh->bh_key, &key, sizeof(key)) == 0 &&
+			    bh->bh_size == sz) {
+				ss->ss_bank = p;
+				ss->ss_banksize = sz;
+				ss->ss_bankused = BANK_HDR;
+				ss->ss_banked = 1;
+				return (-1);
+			}
+			munmap(p, sz);
+		}
+	}
+
+	/* none, or not one for this key: make it */
+	tmp[n - 7] = '.';
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("%s", tmp);
+		return (-1);
+	}
+	if (ftruncate(fd, sz) == -1 || (p = mmap(NULL, sz,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		warn("%s", tmp);
+		unlink(tmp);
+		close(fd);
+		return (-1);
+	}
+	ss->ss_bank = p;
+	ss->ss_banksize = sz;
+	ss->ss_bankused = BANK_HDR;
+	ss->ss_banked = 0;
+	return (fd);
+}
+
+/*
+ * Finish the new bank tmp (fd) and rename it into place.  The samples
+ * are on the disk before the magic is, so a bank cut short by a crash is
+ * never taken for a good one.  Whatever happens the set keeps its
+ * mapping, which from here on is read-only.
+ */
+int
+bank_save(struct sound_set *ss, int fd, const char *tmp)
+{
+	struct bank_hdr *bh = (struct bank_hdr *)ss->ss_bank;
+	char path[PATH_MAX];
+	int r = -1;
+
+	bank_key(ss, &bh->bh_key);
+	bh->bh_size = ss->ss_banksize;
+	memcpy(path, tmp, strlen(tmp) - 7);	/* less the .XXXXXX */
+	path[strlen(tmp) - 7] = '\0';
+	if (msync(ss->ss_bank, ss->ss_banksize, MS_SYNC) == -1)
+		warn("%s", tmp);
+	else {
+		memcpy(bh->bh_magic, BANK_MAGIC, 8);
+		if (msync(ss->ss_bank, BANK_HDR, MS_SYNC) == -1 ||
+		    fchmod(fd, 0644) == -1 || rename(tmp, path) == -1)
+			warn("%s", tmp);
+		else
+			r = 0;
+	}
+	if (r != 0)
+		unlink(tmp);
+	close(fd);
+	mprotect(ss->ss_bank, ss->ss_banksize, PROT_READ);
+	ss->ss_banked = 1;
+	return (r);
+}
+
+void
+bank_unmap(struct sound_set *ss)
+{
+	if (ss->ss_bank == NULL)
+		return;
+	munmap(ss->ss_bank, ss->ss_banksize);
+	ss->ss_bank = NULL;
+	ss->ss_banked = 0;
+}
+
+/*
+ * Samples in an element of units (dits) of tone, including the element
+ * space that follows it.
+ */
+u_int
+elem_len(struct sound_set *ss, double units)
+{
+	float u;
+
+	u = 1.2 / ss->ss_cwpm;
+	return (rintf((units + 1.0) * u * (float)ss->ss_rate));
+}
+
+/*
+ * Silence as long as it is asked for; the timeline says how long.
+ */
+int
+build_gap(struct a_sound *snd, struct sound_set *ss)
+{
+	snd->len = UINT_MAX;
+	return (build_silence(snd, ss));
+}
+
+int
+build_quiet(struct a_sound *snd, struct sound_set *ss)
+{
+	snd->len = ss->ss_blocksize;
+	return (build_silence(snd, ss));
+}
+
+int
+build_dit(struct a_sound *snd, struct sound_set *ss)
+{
+	return (build_snd(snd, ss, 1.0));
+}
+
+int
+build_dah(struct a_sound *snd, struct sound_set *ss)
+{
+	return (build_snd(snd, ss, 3.0));
+}
+
+/*
+ * The tone is worked out in float a block at a time and stored in the
+ * sound set's format as it goes.  An element is the front of the set's
+ * steady tone, its own falling edge, and silence; only the edge is
+ * built here.
+ */
+#define	SND_BLOCK	256
+
+int
+build_snd(struct a_sound *snd, struct sound_set *ss, double units)
+{
+	u_int attack1, attack2, attack3, nsamps, steady;
+	float u;
+
+	u = 1.2 / ss->ss_cwpm;
+	nsamps = elem_len(ss, units);
+	attack2 = (u_int)rintf(units * u * (float)ss->ss_rate);
+	attack1 = ss->ss_envlen;
+	attack3 = attack1 + attack2;
+	if (attack3 > nsamps)
+		attack3 = nsamps;
+	/* full level up to and including attack2, then the edge */
+	steady = attack2 + 1 < attack3 ? attack2 + 1 : attack3;
+	if (steady > ss->ss_tonelen)
+		errx(1, "element longer than the shared tone");
+
+	snd->len = 0;
+	snd->flags = SND_ARENA;
+	snd->nseg = 0;
+	snd->seg = ss_alloc(ss, 3 * sizeof(*snd->seg));
+	snd->buf = ss_samples(ss, (attack3 - steady + 1) * ss->ss_bps);
+	if (snd->seg == NULL || snd->buf == NULL)
+		return (-1);
+	if (attack3 > steady && !ss->ss_banked)
+		render_tone(ss, snd->buf, steady, attack3 - steady,
+		    ss->ss_env + (steady - attack2));
+	snd_addseg(snd, ss->ss_tone, steady);
+	snd_addseg(snd, snd->buf, attack3 - steady);
+	snd_addseg(snd, NULL, nsamps - attack3);
+	return (0);
+}
+
+/*
+ * The steady tone every element starts with, rising edge and all.
+ */
+int
+build_tone(struct sound_set *ss)
+{
+	u_int rise;
+
+	ss->ss_tone = ss_samples(ss, ss->ss_tonelen * ss->ss_bps);
+	if (ss->ss_tone == NULL)
+		return (-1);
+	if (ss->ss_banked)
+		return (0);
+	rise = ss->ss_rise != NULL ? ss->ss_envlen : 0;
+	render_tone(ss, ss->ss_tone, 0, rise, ss->ss_rise);
+	render_tone(ss, (u_char *)ss->ss_tone + rise * ss->ss_bps, rise,
+	    ss->ss_tonelen - rise, NULL);
+	return (0);
+}
+
+/*
+ * Samples start to start + len of the tone, each scaled by env if
+ * given, into dst in the set's format.
+ */
+void
+render_tone(struct sound_set *ss, void *dst, u_int start, u_int len,
+    const float *env)
+{
+	float blk[SND_BLOCK];
+	u_int i, n;
+	double w;
+
+	w = 2.0 * M_PI * ss->ss_hz / ss->ss_rate;
+	for (i = 0; i < len; i += n) {
+		n = len - i < SND_BLOCK ? len - i : SND_BLOCK;
+		synth_tone(blk, n, fmod((start + i) * w, 2.0 * M_PI), w);
+		if (env != NULL)
+			mul_samples(blk, env + i, n);
+		put_samples((u_char *)dst + i * ss->ss_bps, ss->ss_fmt,
+		    blk, n);
+	}
+}
+
+/*
+ * Make snd the single segment buf (NULL for silence) of snd->len samples.
+ */
+void
+snd_single(struct a_sound *snd, const void *buf)
+{
+	snd->seg1.sg_buf = buf;
+	snd->seg1.sg_len = snd->len;
+	snd->seg = &snd->seg1;
+	snd->nseg = 1;
+}
+
+/*
+ * Append a segment to snd, whose seg has room for it; empty ones are
+ * dropped.
+ */
+int
+snd_addseg(struct a_sound *snd, const void *buf, u_int len)
+{
+	if (len == 0)
+		return (0);
+	snd->seg[snd->nseg].sg_buf = buf;
+	snd->seg[snd->nseg].sg_len = len;
+	snd->nseg++;
+	snd->len += len;
+	return (0);
+}
+
+/*
+ * Copy all of snd, bps bytes a sample, into one contiguous buffer.
+ */
+void
+snd_flatten(const struct a_sound *snd, void *dst, u_int bps)
+{
+	u_char *d = dst;
+	u_int i;
+
+	for (i = 0; i < snd->nseg; i++) {
+		if (snd->seg[i].sg_buf == NULL)
+			memset(d, 0, snd->seg[i].sg_len * bps);
+		else
+			memcpy(d, snd->seg[i].sg_buf,
+			    snd->seg[i].sg_len * bps);
+		d += snd->seg[i].sg_len * bps;
+	}
+}
+
+/*
+ * The set's edges, from the tables.
+ */
+int
+build_env(struct sound_set *ss)
+{
+	struct env_tab *et;
+
+	et = env_table(ss->ss_envshape, ss->ss_envlen, ss->ss_rate);
+	ss->ss_env = et->et_fall;
+	ss->ss_rise = et->et_rise;
+	return (0);
+}
+
+/*
+ * The edge table for a shape, length and rate, made the first time it is
+ * asked for.  The exponential edge decays over len samples with a time
+ * constant of a fifth of that and then stops; the shaped ones run from
+ * full to nothing over len samples, and the rising edge is the falling
+ * one backwards.
+ */
+struct env_tab *
+env_table(int shape, u_int len, u_int rate)
+{
+	struct env_tab *et;
+	float T, RC, q;
+	double x;
+	u_int k;
+
+	pthread_mutex_lock(&env_lock);
+	for (et = env_tabs; et != NULL; et = et->et_next)
+		if (et->et_shape == shape && et->et_len == len &&
+		    et->et_rate == rate)
+			break;
+	if (et != NULL) {
+		pthread_mutex_unlock(&env_lock);
+		return (et);
+	}
+
+	et = x_malloc(sizeof(*et));
+	et->et_shape = shape;
+	et->et_len = len;
+	et->et_rate = rate;
+	et->et_fall = x_malloc((2 * len + 1) * sizeof(float));
+	et->et_rise = shape == ENV_EXP ? NULL : et->et_fall + len + 1;
+	T = (double)len / (double)rate;
+	RC = T / 5.0;
+	for (k = 0; k <= len; k++) {
+		x = len == 0 ? 1.0 : (double)k / len;
+		switch (shape) {
+		case ENV_EXP:
+			q = (double)k / (double)rate;
+			et->et_fall[k] = k < len ? expf(-q / RC) : 0.0;
+			break;
+		case ENV_COS:
+			et->et_fall[k] = 0.5 * (1.0 + cos(M_PI * x));
+			break;
+		case ENV_BH:
+			/* the window from its middle (1) to its end (0) */
+			x = 0.5 + 0.5 * x;
+			et->et_fall[k] = 0.35875 -
+			    0.48829 * cos(2.0 * M_PI * x) +
+			    0.14128 * cos(4.0 * M_PI * x) -
+			    0.01168 * cos(6.0 * M_PI * x);
+			break;
+		}
+	}
+	if (et->et_rise != NULL)
+		for (k = 0; k < len; k++)
+			et->et_rise[k] = et->et_fall[len - k];
+	et->et_next = env_tabs;
+	env_tabs = et;
+	pthread_mutex_unlock(&env_lock);
+	return (et);
+}
+
+/*
+ * out[i] = sin(ph + i * w) for i < n, four samples at a time from a
+ * rotating phasor.  The phasor is set up exactly on each call, so with n
+ * kept to a block rounding never gets the chance to build up.
+ */
+void
+synth_tone(float *out, u_int n, double ph, double w)
+{
+	float s[4], c[4], s4, c4;
+	u_int i = 0, k;
+#if defined(__SSE__)
+	__m128 vs, vc, vs4, vc4, t;
+#elif defined(__ARM_NEON)
+	float32x4_t vs, vc, t;
+#else
+	float t;
+#endif
+
+	for (k = 0; k < 4; k++) {
+		s[k] = sin(ph + k * w);
+		c[k] = cos(ph + k * w);
+	}
+	s4 = sin(4.0 * w);
+	c4 = cos(4.0 * w);
+
+#if defined(__SSE__)
+	vs = _mm_loadu_ps(s);
+	vc = _mm_loadu_ps(c);
+	vs4 = _mm_set1_ps(s4);
+	vc4 = _mm_set1_ps(c4);
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(out + i, vs);
+		t = _mm_add_ps(_mm_mul_ps(vs, vc4), _mm_mul_ps(vc, vs4));
+		vc = _mm_sub_ps(_mm_mul_ps(vc, vc4), _mm_mul_ps(vs, vs4));
+		vs = t;
+	}
+	_mm_storeu_ps(s, vs);
+#elif defined(__ARM_NEON)
+	vs = vld1q_f32(s);
+	vc = vld1q_f32(c);
+	for (; i + 4 <= n; i += 4) {
+		vst1q_f32(out + i, vs);
+		t = vmlaq_n_f32(vmulq_n_f32(vs, c4), vc, s4);
+		vc = vmlsq_n_f32(vmulq_n_f32(vc, c4), vs, s4);
+		vs = t;
+	}
+	vst1q_f32(s, vs);
+#else
+	for (; i + 4 <= n; i += 4) {
+		for (k = 0; k < 4; k++) {
+			out[i + k] = s[k];
+			t = s[k] * c4 + c[k] * s4;
+			c[k] = c[k] * c4 - s[k] * s4;
+			s[k] = t;
+		}
+	}
+#endif
+	for (k = 0; i < n; i++, k++)
+		out[i] = s[k];
+}
+
+/*
+ * out[i] *= m[i] for i < n.
+ */
+void
+mul_samples(float *out, const float *m, u_int n)
+{
+	u_int i = 0;
+
+#if defined(__SSE__)
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(out + i),
+		    _mm_loadu_ps(m + i)));
+#elif defined(__ARM_NEON)
+	for (; i + 4 <= n; i += 4)
+		vst1q_f32(out + i, vmulq_f32(vld1q_f32(out + i),
+		    vld1q_f32(m + i)));
+#endif
+	for (; i < n; i++)
+		out[i] *= m[i];
+}
+
+/*
+ * The original per-sample synthesis, kept as the reference build_snd is
+ * checked against (see synth_check()).
+ */
+int
+build_snd_ref(struct a_sound *snd, struct sound_set *ss, double units)
+{
+	u_int i, attack1, attack2, attack3, nsamps, idx;
+	float u, m, blk[SND_BLOCK];
+
+	u = 1.2 / ss->ss_cwpm;
+	nsamps = rintf((units + 1.0) * u * (float)ss->ss_rate);
+	snd->len = nsamps;
+	snd->buf = x_malloc(snd->len * ss->ss_bps);
+	if (snd->buf == NULL)
+		return (-1);
+	attack2 = (u_int)rintf(units * u * (float)ss->ss_rate);
+
+	u = (1.2 / ss->ss_cwpm) * 0.2;
+
+	if (u > 0.006)
+		u = 0.006;
+
+	u *= (float)ss->ss_rate;
+	attack1 = (u_int)u;
+	attack3 = attack1 + attack2;
+
+
+	for (i = 0, idx = 0; i < nsamps; i++) {
+		float t = (float)i / (float)ss->ss_rate;
+
+		if (i < attack1) {
+			float T = (double)attack1 / (double)ss->ss_rate;
+			float RC = T / 5.0;
+
+			m = 1.0 * (1 - expf(-t / RC));
+			m = 1.0;
+		} else if (i > attack2 && i < attack3) {
+			float T = (double)attack1 / (double)ss->ss_rate;
+			float RC = T / 5.0;
+			float q = (double)(i - attack2) / (double)ss->ss_rate;
+
+			m = 1.0 * expf(-q / RC);
+		} else if (i >= attack3)
+			m = 0.0;
+		else
+			m = 1.0;
+
+		blk[idx++] = m * sinf(t * 2.0f * M_PI * ss->ss_hz);
+		if (idx == SND_BLOCK || i + 1 == nsamps) {
+			put_samples((u_char *)snd->buf +
+			    (i + 1 - idx) * ss->ss_bps, ss->ss_fmt, blk, idx);
+			idx = 0;
+		}
+	}
+	snd->flags = 0;
+	snd_single(snd, snd->buf);
+	return (0);
+}
+
+/*
+ * Store n float samples (nominally -1 to 1) in format fmt, clipping the
+ * integer formats.
+ */
+void
+put_samples(void *dst, int fmt, const float *src, u_int n)
+{
+	u_char *p = dst;
+	u_int i;
+	long v;
+
+	switch (fmt) {
+	case SF_F32:
+		memcpy(dst, src, n * sizeof(float));
+		break;
+	case SF_S16:
+		for (i = 0; i < n; i++, p += 2) {
+			int16_t s;
+
+			v = lrintf(src[i] * 32767.0f);
+			if (v > 32767)
+				v = 32767;
+			else if (v < -32768)
+				v = -32768;
+			s = (int16_t)v;
+			memcpy(p, &s, sizeof(s));
+		}
+		break;
+	case SF_S24:
+		for (i = 0; i < n; i++, p += 3) {
+			v = lrintf(src[i] * 8388607.0f);
+			if (v > 8388607)
+				v = 8388607;
+			else if (v < -8388608)
+				v = -8388608;
+#if BYTE_ORDER == BIG_ENDIAN
+			p[0] = (v >> 16) & 0xff;
+			p[1] = (v >> 8) & 0xff;
+			p[2] = v & 0xff;
+#else
+			p[0] = v & 0xff;
+			p[1] = (v >> 8) & 0xff;
+			p[2] = (v >> 16) & 0xff;
+#endif
+		}
+		break;
+	}
+}
+
+/*
+ * The other way, from n samples as they are in a file: integers little
+ * endian, floats as the host has them.
+ */
+void
+get_samples(float *dst, int fmt, const u_char *src, u_int n)
+{
+	int32_t v;
+	u_int i;
+
+	switch (fmt) {
+	case SF_F32:
+		memcpy(dst, src, n * sizeof(float));
+		break;
+	case SF_S16:
+		for (i = 0; i < n; i++, src += 2)
+			dst[i] = (int16_t)(src[0] | src[1] << 8) *
+			    (1.0f / 32768.0f);
+		break;
+	case SF_S24:
+		for (i = 0; i < n; i++, src += 3) {
+			v = (int32_t)((u_int32_t)src[0] << 8 |
+			    (u_int32_t)src[1] << 16 | (u_int32_t)src[2] << 24);
+			dst[i] = (v >> 8) * (1.0f / 8388608.0f);
+		}
+		break;
+	}
+}
+
+/*
+ * Silence is a single segment with no buffer behind it; however long it
+ * is, it costs nothing but its length.
+ */
+int
+build_silence(struct a_sound *snd, struct sound_set *ss)
+{
+	snd->flags |= SND_SILENT;
+	snd->buf = NULL;
+	snd_single(snd, NULL);
+	return (0);
+}
+
+void
+init_sounds(struct sound_set *ss, u_int rate, int fmt, u_int blocksize,
+    double owpm, double cwpm, float hz)
+{
+	memset(ss, 0, sizeof(*ss));
+	ss->ss_rate = rate;
+	ss->ss_fmt = fmt;
+	ss->ss_bps = sf_bps[fmt];
+	ss->ss_blocksize = blocksize;
+	ss->ss_owpm = owpm;
+	ss->ss_cwpm = cwpm;
+	ss->ss_hz = hz;
+	sound_lens(ss);
+}
+
+/*
+ * Memory in the arena goes with the set, in destroy_sounds().
+ */
+void
+destroy_sound(struct a_sound *snd)
+{
+	if (!(snd->flags & SND_ARENA)) {
+		if (snd->buf != NULL)
+			x_free(snd->buf);
+		if (snd->seg != NULL && snd->seg != &snd->seg1)
+			x_free(snd->seg);
+	}
+	snd->len = 0;
+	snd->flags = 0;
+	snd->buf = NULL;
+	snd->seg = NULL;
+	snd->nseg = 0;
+}
+
+void
+destroy_sounds(struct sound_set *ss)
+{
+	destroy_sound(&ss->ss_dit);
+	destroy_sound(&ss->ss_dah);
+	destroy_sound(&ss->ss_gap);
+	destroy_sound(&ss->ss_quiet);
+	destroy_charsnds(ss);
+	ss->ss_env = NULL;
+	ss->ss_rise = NULL;
+	ss->ss_tone = NULL;
+	ss_freearena(ss);
+}
+
+/*
+ * Rebuild everything that depends on the rate and pitch parameters.
+ */
+int
+build_sounds(struct sound_set *ss)
+{
+	char tmp[PATH_MAX];
+	int r, fd = -1;
+
+	if (sound_bank != NULL)
+		fd = bank_open(ss, tmp, sizeof(tmp));
+	if ((r = build_elements(ss)) == 0 && (r = build_charsnds(ss)) != 0)
+		destroy_sounds(ss);
+	if (fd != -1) {
+		if (r == 0)
+			bank_save(ss, fd, tmp);
+		else {
+			unlink(tmp);
+			close(fd);
+		}
+	}
+	if (r == 0 && lock_stats != NULL)
+		ss_lock(ss);
+	return (r);
+}
+
+/*
+ * A set of sounds of its own, for an engine to own.
+ */
+struct sound_set *
+make_sounds(u_int rate, int fmt, u_int blocksize, double owpm, double cwpm,
+    float hz)
+{
+	struct sound_set *ss;
+
+	ss = x_malloc(sizeof(*ss));
+	init_sounds(ss, rate, fmt, blocksize, owpm, cwpm, hz);
+	if (build_sounds(ss) != 0) {
+		x_free(ss);
+		return (NULL);
+	}
+	return (ss);
+}
+
+void
+free_sounds(struct sound_set *ss)
+{
+	if (ss == NULL)
+		return;
+	destroy_sounds(ss);
+	x_free(ss);
+}
+
+int
+build_elements(struct sound_set *ss)
+{
+	int r;
+
+	if ((r = build_env(ss)) != 0) {
+		destroy_sounds(ss);
+		return (r);
+	}
+	if ((r = build_tone(ss)) != 0) {
+		destroy_sounds(ss);
+		return (r);
+	}
+	if ((r = build_dit(&ss->ss_dit, ss)) != 0) {
+		destroy_sounds(ss);
+		return (r);
+	}
+	if ((r = build_dah(&ss->ss_dah, ss)) != 0) {
+		destroy_sounds(ss);
+		return (r);
+	}
+	if ((r = build_gap(&ss->ss_gap, ss)) != 0) {
+		destroy_sounds(ss);
+		return (r);
+	}
+	if ((r = build_quiet(&ss->ss_quiet, ss)) != 0) {
+		destroy_sounds(ss);
+		return (r);
+	}
+	return (0);
+}
+
+/*
+ * How far, in percent, the sound set's lengths put a PARIS word off its
+ * overall rate; the wpm they actually give goes in *wpm.  With report
+ * set, misses beyond TIME_TOL are printed.
+ */
+#define	TIME_TOL	1.0
+
+float
+time_check(struct sound_set *ss, float *wpm, int report)
+{
+	float sampmin;
+	float perword, e, m;
+
+	perword = 0;
+	perword += 10 * ss->ss_ditlen;
+	perword += 4 * ss->ss_dahlen;
+	perword += 5 * ss->ss_inCharlen;
+	perword += 1 * ss->ss_inWordlen;
+	
+	sampmin = (float)ss->ss_rate * 60.0;
+	m = sampmin/perword;
+	e = (fabs(m - ss->ss_owpm)/ss->ss_owpm) * 100;
+	if (report && e > TIME_TOL) {
+		printf("dit %u dah %u inChar %u inWord %u\n",
+		    ss->ss_ditlen, ss->ss_dahlen, ss->ss_inCharlen,
+		    ss->ss_inWordlen);
+		printf("sampmin %f / perword %f = %f wpm (target %f), "
+		    "error %.2f%%\n", sampmin, perword, m, ss->ss_owpm, e);
+	}
+	*wpm = m;
+	return (e);
+}
+
+/*
+ * Check the timing of every (overall, character) rate pair from 1 to
+ * TIME_MAXWPM in steps of step, on njobs threads (one per CPU if 0).
+ * Only the lengths are worked out, so this is cheap even on a fine
+ * grid.  With mr set, misses and a closing line of statistics are
+ * printed as whitespace separated fields for scripts; otherwise misses
+ * are described as time_check() always has.  Returns the number of
+ * misses.
+ */
+#define	TIME_MAXWPM	100.0
+
+u_long
+test_times(u_int rate, float step, u_int njobs, int mr)
+{
+	struct tsweep ts;
+	pthread_t *tids;
+	u_int i;
+
+	ts.ts_rate = rate;
+	ts.ts_step = step;
+	ts.ts_mr = mr;
+	ts.ts_nrows = (u_int)((TIME_MAXWPM - 1.0) / step + 1e-6) + 1;
+	atomic_init(&ts.ts_next, 0);
+	pthread_mutex_init(&ts.ts_lock, NULL);
+	ts.ts_n = ts.ts_over = 0;
+	ts.ts_max = ts.ts_sum = ts.ts_sumsq = 0.0;
+	ts.ts_maxo = ts.ts_maxc = 0.0;
+
+	if (njobs == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		njobs = n < 1 ? 1 : n;
+	}
+	if (njobs > ts.ts_nrows)
+		njobs = ts.ts_nrows;
+	if (mr)
+		printf("# owpm cwpm wpm error%%, for errors over %.2f%%\n",
+		    TIME_TOL);
+	tids = x_malloc(njobs * sizeof(*tids));
+	for (i = 0; i < njobs; i++)
+		if ((errno = pthread_create(&tids[i], NULL, times_worker,
+		    &ts)) != 0)
+			err(1, "pthread_create");
+	for (i = 0; i < njobs; i++)
+		pthread_join(tids[i], NULL);
+	x_free(tids);
+	pthread_mutex_destroy(&ts.ts_lock);
+
+	if (mr) {
+		printf("# rate step points over max_error max_owpm max_cwpm "
+		    "mean_error rms_error\n");
+		printf("stats %u %g %lu %lu %.4f %.2f %.2f %.4f %.4f\n",
+		    rate, step, ts.ts_n, ts.ts_over, ts.ts_max, ts.ts_maxo,
+		    ts.ts_maxc, ts.ts_sum / ts.ts_n,
+		    sqrt(ts.ts_sumsq / ts.ts_n));
+	}
+	return (ts.ts_over);
+}
+
+/*
+ * Take rows (overall rates) of the sweep until there are none left,
+ * then fold this thread's statistics into the total.
+ */
+void *
+times_worker(void *arg)
+{
+	struct tsweep *ts = arg;
+	struct sound_set ss;
+	u_long n = 0, over = 0;
+	double max = 0.0, maxo = 0.0, maxc = 0.0, sum = 0.0, sumsq = 0.0;
+	float o, c, e, wpm;
+	u_int i, j;
+
+	while ((i = atomic_fetch_add(&ts->ts_next, 1)) < ts->ts_nrows) {
+		o = 1.0 + i * ts->ts_step;
+		for (j = i; j < ts->ts_nrows; j++) {
+			c = 1.0 + j * ts->ts_step;
+			init_sounds(&ss, ts->ts_rate, SF_F32, 0, o, c, 720.0);
+			e = time_check(&ss, &wpm, 0);
+			n++;
+			sum += e;
+			sumsq += (double)e * e;
+			if (e > max) {
+				max = e;
+				maxo = o;
+				maxc = c;
+			}
+			if (e <= TIME_TOL)
+				continue;
+			over++;
+			pthread_mutex_lock(&ts->ts_lock);
+			if (ts->ts_mr)
+				printf("%.2f %.2f %.4f %.4f\n", o, c, wpm, e);
+			else
+				time_check(&ss, &wpm, 1);
+			pthread_mutex_unlock(&ts->ts_lock);
+		}
+	}
+
+	pthread_mutex_lock(&ts->ts_lock);
+	ts->ts_n += n;
+	ts->ts_over += over;
+	ts->ts_sum += sum;
+	ts->ts_sumsq += sumsq;
+	if (max > ts->ts_max) {
+		ts->ts_max = max;
+		ts->ts_maxo = maxo;
+		ts->ts_maxc = maxc;
+	}
+	pthread_mutex_unlock(&ts->ts_lock);
+	return (NULL);
+}
+
+/*
+ * Check build_snd against build_snd_ref over a spread of rates and
+ * pitches.  The reference rounds its phase to float, which late in a
+ * long element is worth a few parts in a thousand, so both are measured
+ * against the same tone worked out in double and an element is reported
+ * if build_snd is worse than the reference by more than SYNTH_TOL.
+ */
+#define	SYNTH_TOL	1e-4
+
+void
+synth_check(struct s_params *pars)
+{
+	static const float hzs[] = { 300.0, 720.0, 1500.0, 4000.0 };
+	struct sound_set ss;
+	struct a_sound fast, ref;
+	float c, df, dr, worst = 0.0, *fbuf;
+	u_int h, i, units, edge;
+	double w, x, y;
+
+	for (c = 1.0; c <= 70.0; c++) {
+		for (h = 0; h < sizeof(hzs) / sizeof(hzs[0]); h++) {
+			init_sounds(&ss, pars->sp_rate, SF_F32, 0, c, c,
+			    hzs[h]);
+			build_env(&ss);
+			build_tone(&ss);
+			w = 2.0 * M_PI * hzs[h] / pars->sp_rate;
+			for (units = 1; units <= 3; units += 2) {
+				build_snd(&fast, &ss, units);
+				build_snd_ref(&ref, &ss, units);
+				fbuf = x_malloc(fast.len * sizeof(float));
+				snd_flatten(&fast, fbuf, sizeof(float));
+				edge = (u_int)rintf(units * (1.2 / c) *
+				    (float)pars->sp_rate);
+				for (df = dr = 0.0, i = 0; i < fast.len; i++) {
+					y = sin(fmod(i * w, 2.0 * M_PI));
+					if (i <= edge)
+						x = y;
+					else if (i < edge + ss.ss_envlen)
+						x = y * ss.ss_env[i - edge];
+					else
+						x = 0.0;
+					if (i < ss.ss_envlen &&
+					    ss.ss_rise != NULL)
+						x *= ss.ss_rise[i];
+					df = fmax(df,
+					    fabs(fbuf[i] - x));
+					dr = fmax(dr,
+					    fabs(((float *)ref.buf)[i] - x));
+				}
+				if (df > dr + SYNTH_TOL)
+					printf("cwpm %.0f %.0fHz %s: error %g, "
+					    "reference %g\n", c, hzs[h],
+					    units == 1 ? "dit" : "dah", df, dr);
+				if (df > worst)
+					worst = df;
+				x_free(fbuf);
+				destroy_sound(&fast);
+				destroy_sound(&ref);
+			}
+			destroy_sounds(&ss);
+		}
+	}
+	if (diagmode > 1)
+		printf("synthesis: max error %g\n", worst);
+}
+
+/*
+ * Benchmarks (make bench), for comparing one build with another.  Every
+ * result is a line of whitespace separated fields: what was measured
+ * and how, then each figure followed by its unit.  Allocations are the
+ * x_malloc() calls made while measuring, per set, call or pass.
+ */
+#define	BENCH_SECS	0.5		/* least time spent on each figure */
+
+double
+bench_now(void)
+{
+	return (mono_ns() / 1e9);
+}
+
+int
+bench_main(struct s_params *pars, const char *text)
+{
+	printf("# rate %u\n", pars->sp_rate);
+	bench_sounds(pars->sp_rate);
+	bench_callback(pars->sp_rate);
+	bench_fetch(pars->sp_rate, text);
+	return (0);
+}
+
+/*
+ * Building a whole sound set, in each format at a few typical rates and
+ * pitches.
+ */
+void
+bench_sounds(u_int rate)
+{
+	static const float sets[][3] = {
+		{ 5.0, 18.0, 720.0 },
+		{ 13.0, 13.0, 600.0 },
+		{ 20.0, 20.0, 720.0 },
+		{ 40.0, 40.0, 1000.0 },
+	};
+	struct sound_set *ss;
+	u_long n, a;
+	double t, t0;
+	u_int i;
+	int fmt;
+
+	printf("# sounds format owpm cwpm hz time allocs\n");
+	for (fmt = 0; fmt < SF_NFMT; fmt++) {
+		for (i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+			a = atomic_load(&xm_count);
+			t0 = bench_now();
+			n = 0;
+			do {
+				ss = make_sounds(rate, fmt, 0, sets[i][0],
+				    sets[i][1], sets[i][2]);
+				if (ss == NULL)
+					errx(1, "unable to build sounds");
+				free_sounds(ss);
+				n++;
+			} while ((t = bench_now() - t0) < BENCH_SECS);
+			printf("sounds %s %g %g %g %.1f us/set "
+			    "%lu allocs/set\n",
+			    sf_name[fmt], sets[i][0], sets[i][1], sets[i][2],
+			    t / n * 1e6, (atomic_load(&xm_count) - a) / n);
+		}
+	}
+}
+
+/*
+ * mp_callback() into a buffer of its own, down each of its paths, at a
+ * spread of block sizes.  The voices are kept queued up between runs of
+ * calls; only the calls are timed.  On the "ahead" path the blocks are
+ * rendered first, as the render thread of -a would, and the calls only
+ * copy them.
+ */
+void
+bench_callback(u_int rate)
+{
+	static const struct {
+		const char *name;
+		u_int nvoices;
+		int mix;
+		int fmt;
+		u_int chans;
+		int ahead;
+	} paths[] = {
+		{ "copy", 1, 0, SF_F32, 2, 0 },
+		{ "copy", 1, 0, SF_S16, 2, 0 },
+		{ "copy", 1, 0, SF_S16, 1, 0 },
+		{ "mix", 4, 1, SF_F32, 2, 0 },
+		{ "mix", 4, 1, SF_S16, 1, 0 },
+		{ "ahead", 4, 1, SF_S16, 2, 1 },
+	};
+	static const u_int blocks[] = { 64, 256, 1024, 4096 };
+	struct s_params bp;
+	struct voice *v;
+	void *out;
+	u_int p, b, i, k, nb, frames;
+	u_long nf, ncalls, a;
+	double t, t0;
+
+	out = x_malloc(4096 * 2 * sizeof(float));
+	printf("# callback path format chans voices frames time allocs\n");
+	for (p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+		memset(&bp, 0, sizeof(bp));
+		stats_init(&bp.sp_stats);
+		bp.sp_rate = rate;
+		bp.sp_fmt = paths[p].fmt;
+		bp.sp_chans = paths[p].chans;
+		bp.sp_nvoices = paths[p].nvoices;
+		bp.sp_voices = x_malloc(bp.sp_nvoices * sizeof(*bp.sp_voices));
+		for (i = 0; i < bp.sp_nvoices; i++) {
+			v = &bp.sp_voices[i];
+			memset(v, 0, sizeof(*v));
+			atomic_init(&v->v_wait, 0);
+			v->v_mix = paths[p].mix;
+			v->v_fmt = v->v_mix ? SF_F32 : bp.sp_fmt;
+			v->v_gain[0] = v->v_gain[1] = 1.0 / bp.sp_nvoices;
+			v->v_eng = engine_create();
+			if (engine_configure(v->v_eng, rate, v->v_fmt, 0,
+			    20.0, 20.0, 600.0 + 100.0 * i) != 0)
+				errx(1, "unable to build sounds");
+		}
+		for (b = 0; b < sizeof(blocks) / sizeof(blocks[0]); b++) {
+			frames = blocks[b];
+			t = 0.0;
+			nf = ncalls = 0;
+			if (paths[p].ahead)
+				rq_init(&bp, RQ_MAXBLK, frames);
+			a = atomic_load(&xm_count);
+			do {
+				nb = UINT_MAX;
+				for (i = 0; i < bp.sp_nvoices; i++) {
+					v = &bp.sp_voices[i];
+					bench_fill(v->v_eng);
+					k = playlist_nsamps(&v->v_eng->e_ph) /
+					    frames;
+					if (k < nb)
+						nb = k;
+				}
+				if (bp.sp_rq != NULL) {
+					for (k = 0; k < nb && rq_fill(&bp) == 0;
+					    k++)
+						;
+					nb = k;
+				}
+				t0 = bench_now();
+				for (k = 0; k < nb; k++)
+					mp_callback(NULL, out, frames, NULL, 0,
+					    &bp);
+				t += bench_now() - t0;
+				nf += (u_long)nb * frames;
+				ncalls += nb;
+			} while (t < BENCH_SECS);
+			printf("callback %s %s %u %u %u %.3f ns/frame "
+			    "%lu allocs/call\n", paths[p].name,
+			    sf_name[bp.sp_fmt], bp.sp_chans, bp.sp_nvoices,
+			    frames, t / nf * 1e9,
+			    (atomic_load(&xm_count) - a) / ncalls);
+			if (bp.sp_rq != NULL) {
+				rq_free(bp.sp_rq);
+				bp.sp_rq = NULL;
+			}
+		}
+		for (i = 0; i < bp.sp_nvoices; i++)
+			engine_destroy(bp.sp_voices[i].v_eng);
+		x_free(bp.sp_voices);
+	}
+	x_free(out);
+}
+
+/*
+ * Queue text on eng until its play list is full.
+ */
+void
+bench_fill(struct engine *eng)
+{
+	static const u_char text[] = "paris paris paris paris ";
+
+	while (PL_RINGSIZE - playlist_nent(&eng->e_ph) >= 2)
+		engine_text(eng, text, sizeof(text) - 1, UINT_MAX);
+}
+
+/*
+ * Text through fetch_chars() and onto the play list, as fast as it will
+ * go: the list is emptied as soon as it fills, with nothing rendered.
+ * The file is read over from the start until enough time has passed.
+ */
+void
+bench_fetch(u_int rate, const char *text)
+{
+	struct engine *eng;
+	struct in_buf ib;
+	struct stat st;
+	u_long passes = 0, a;
+	double t, t0;
+	int fd;
+
+	if ((fd = open(text, O_RDONLY)) == -1)
+		err(1, "%s", text);
+	if (fstat(fd, &st) == -1)
+		err(1, "%s", text);
+	if (!S_ISREG(st.st_mode) || st.st_size == 0)
+		errx(1, "%s: not a regular file with text in it", text);
+	eng = engine_create();
+	if (engine_configure(eng, rate, SF_F32, 0, 20.0, 20.0, 720.0) != 0)
+		errx(1, "unable to build sounds");
+
+	printf("# fetch file bytes rate allocs\n");
+	a = atomic_load(&xm_count);
+	t0 = bench_now();
+	do {
+		if (lseek(fd, 0, SEEK_SET) == -1)
+			err(1, "%s", text);
+		in_open(&ib, fd, IN_MAXBUF);
+		while (!fetch_chars(&ib, eng, UINT_MAX))
+			playlist_destroy(&eng->e_ph);
+		playlist_destroy(&eng->e_ph);
+		in_close(&ib);
+		passes++;
+	} while ((t = bench_now() - t0) < BENCH_SECS);
+	printf("fetch %s %lld %.0f chars/s %lu allocs/pass\n", text,
+	    (long long)st.st_size, passes * (double)st.st_size / t,
+	    (atomic_load(&xm_count) - a) / passes);
+	engine_destroy(eng);
+	close(fd);
+}
+
+int
+getfloat(const char *s, float *fp)
+{
+	char *ep;
+	double d;
+
+	errno = 0;
+	d = strtod(s, &ep);
+	if (s[0] == '\0' || *ep != '\0')
+		return (-1);
+	if (errno == ERANGE && (d = HUGE_VAL || d == -HUGE_VAL))
+		return (-1);
+	if (d > FLT_MAX || d < FLT_MIN || isnan(d) || isinf(d))
+		return (-1);
+	*fp = (float)d;
+	return (0);
+}
+
+/*
+ * Fill in whichever of the rates was not given (-1.0), following the ARRL
+ * Farnsworth rules.  Fails if the overall rate exceeds the character rate.
+ */
+int
+pick_rates(float *owpm, float *cwpm)
+{
+	if (*owpm == -1.0 && *cwpm == -1.0) {
+		/* Neither specified, assume Element 1 rates */
+		*owpm = 5.0;
+		*cwpm = 18.0;
+	} else if (*cwpm == -1.0) {
+		/* Overall set, assume ARRL Farnsworth rules */
+		if (*owpm > 18.0)
+			*cwpm = *owpm;
+		else
+			*cwpm = 18.0;
+	} else if (*owpm == -1.0) {
+		/* Character set, assume overall == cwpm */
+		*owpm = *cwpm;
+	} else {
+		/* both set, ensure sanity */
+		if (*owpm > *cwpm)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Render every job in the list on a pool of njobs threads (one per CPU
+ * if 0).  The sound sets are all built up front, in the output format,
+ * and only read by the workers; each job gets its own play list and
+ * output buffer.
+ */
+int
+batch_main(const char *list, u_int njobs, int otype, int fmt, u_int rate,
+    size_t inbuf, float owpm, float cwpm, float hz)
+{
+	struct batch b;
+	pthread_t *tids;
+	FILE *f;
+	u_int i;
+	int r = 0;
+
+	if (strcmp(list, "-") == 0)
+		f = stdin;
+	else if ((f = fopen(list, "r")) == NULL)
+		err(1, "%s", list);
+	b.b_otype = otype;
+	b.b_fmt = fmt;
+	b.b_rate = rate;
+	b.b_inbuf = inbuf;
+	if (batch_parse(&b, f, owpm, cwpm, hz) != 0)
+		return (1);
+	if (f != stdin)
+		fclose(f);
+	atomic_init(&b.b_next, 0);
+
+	if (njobs == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		njobs = n < 1 ? 1 : n;
+	}
+	if (njobs > b.b_njobs)
+		njobs = b.b_njobs;
+
+	tids = x_malloc(njobs * sizeof(*tids));
+	for (i = 0; i < njobs; i++)
+		if ((errno = pthread_create(&tids[i], NULL, batch_worker,
+		    &b)) != 0)
+			err(1, "pthread_create");
+	for (i = 0; i < njobs; i++)
+		pthread_join(tids[i], NULL);
+	x_free(tids);
+
+	for (i = 0; i < b.b_njobs; i++) {
+		struct batch_job *bj = &b.b_jobs[i];
+		u_int j;
+
+		if (bj->bj_err)
+			r = 1;
+		/* free each shared set once, at its first user */
+		for (j = 0; j < i; j++)
+			if (b.b_jobs[j].bj_ss == bj->bj_ss)
+				break;
+		if (j == i) {
+			destroy_sounds(bj->bj_ss);
+			x_free(bj->bj_ss);
+		}
+		x_free(bj->bj_in);
+	}
+	x_free(b.b_jobs);
+	return (r);
+}
+
+/*
+ * Read the job list: "input output [wpm [cwpm [freq]]]" per line, blank
+ * lines and lines starting with '#' ignored.  Missing rates and pitch
+ * default to the ones given on the command line.
+ */
+int
+batch_parse(struct batch *b, FILE *f, float owpm, float cwpm, float hz)
+{
+	char *line = NULL, *p, *fld[5];
+	size_t linesz = 0;
+	u_int lineno = 0, maxjobs = 0, i, nf;
+	ssize_t len;
+
+	b->b_jobs = NULL;
+	b->b_njobs = 0;
+	while ((len = getline(&line, &linesz, f)) != -1) {
+		struct batch_job *bj;
+		float o = owpm, c = cwpm, h = hz;
+
+		lineno++;
+		for (p = line, nf = 0; nf < 5 &&
+		    (fld[nf] = strsep(&p, " \t\r\n")) != NULL;) {
+			if (*fld[nf] != '\0')
+				nf++;
+		}
+		if (nf == 0 || fld[0][0] == '#')
+			continue;
+		if (nf < 2 || (p != NULL && p[strspn(p, " \t\r\n")] != '\0')) {
+			warnx("line %u: expected input output "
+			    "[wpm [cwpm [freq]]]", lineno);
+			return (-1);
+		}
+		if (nf > 2) {
+			c = -1.0;
+			if (getfloat(fld[2], &o) || o < 1.0 || o > 70.0) {
+				warnx("line %u: invalid overall rate %s",
+				    lineno, fld[2]);
+				return (-1);
+			}
+		}
+		if (nf > 3 && (getfloat(fld[3], &c) || c < 1.0 || c > 70.0)) {
+			warnx("line %u: invalid character rate %s",
+			    lineno, fld[3]);
+			return (-1);
+		}
+		if (nf > 4 && (getfloat(fld[4], &h) || h < 1.0 ||
+		    h > 20000.0)) {
+			warnx("line %u: invalid frequency %s", lineno, fld[4]);
+			return (-1);
+		}
+		if (pick_rates(&o, &c) != 0) {
+			warnx("line %u: character rate %f < overall rate %f",
+			    lineno, c, o);
+			return (-1);
+		}
+
+		if (b->b_njobs == maxjobs) {
+			maxjobs = maxjobs ? maxjobs * 2 : 32;
+			if ((b->b_jobs = realloc(b->b_jobs,
+			    maxjobs * sizeof(*bj))) == NULL)
+				err(1, "realloc");
+		}
+		bj = &b->b_jobs[b->b_njobs];
+		/* one allocation holds both names */
+		bj->bj_in = x_malloc(strlen(fld[0]) + strlen(fld[1]) + 2);
+		strcpy(bj->bj_in, fld[0]);
+		bj->bj_out = bj->bj_in + strlen(fld[0]) + 1;
+		strcpy(bj->bj_out, fld[1]);
+		bj->bj_err = 0;
+
+		for (i = 0; i < b->b_njobs; i++) {
+			struct sound_set *ss = b->b_jobs[i].bj_ss;
+
+			if (ss->ss_owpm == o && ss->ss_cwpm == c &&
+			    ss->ss_hz == h)
+				break;
+		}
+		if (i < b->b_njobs)
+			bj->bj_ss = b->b_jobs[i].bj_ss;
+		else {
+			bj->bj_ss = x_malloc(sizeof(*bj->bj_ss));
+			init_sounds(bj->bj_ss, b->b_rate, b->b_fmt, 0, o, c,
+			    h);
+			if (build_sounds(bj->bj_ss) != 0)
+				errx(1, "unable to build sounds");
+		}
+		b->b_njobs++;
+	}
+	free(line);
+	if (ferror(f))
+		err(1, "getline");
+	return (0);
+}
+
+void *
+batch_worker(void *arg)
+{
+	struct batch *b = arg;
+	u_int i;
+
+	while ((i = atomic_fetch_add(&b->b_next, 1)) < b->b_njobs)
+		b->b_jobs[i].bj_err = batch_render(&b->b_jobs[i], b);
+	return (NULL);
+}
+
+int
+batch_render(struct batch_job *bj, struct batch *b)
+{
+	struct s_params pars;
+	struct out_file *of;
+	int ifd, ofd;
+
+	if ((ifd = open(bj->bj_in, O_RDONLY)) == -1) {
+		warn("%s", bj->bj_in);
+		return (-1);
+	}
+	if ((ofd = open(bj->bj_out, O_WRONLY | O_CREAT | O_TRUNC,
+	    0666)) == -1) {
+		warn("%s", bj->bj_out);
+		close(ifd);
+		return (-1);
+	}
+
+	memset(&pars, 0, sizeof(pars));
+	pars.sp_rate = bj->bj_ss->ss_rate;
+	pars.sp_inbuf = b->b_inbuf;
+	pars.sp_eng = engine_create();
+	engine_share(pars.sp_eng, bj->bj_ss);
+	pars.sp_out = of = x_malloc(sizeof(*of));
+	of_open(of, ofd, b->b_otype, b->b_fmt, pars.sp_rate);
+	file_loop(&pars, ifd);
+	of_close(of);
+	close(ifd);
+	x_free(of);
+	engine_destroy(pars.sp_eng);
+	return (0);
+}
+
+/*
+ * Serve the text given on the standard input and in UDP datagrams to
+ * port, as audio of type and fmt, to everyone who connects to port over
+ * TCP.  Runs until killed.
+ */
+int
+server_main(const char *port, int type, int fmt, u_int rate, size_t inbuf,
+    float owpm, float cwpm, float hz)
+{
+	struct server *sv;
+	struct sv_client *cl;
+	struct pollfd *pfd;
+	u_int64_t t0, now, due, blockns;
+	u_int i, n, ifd, ufd;
+	ssize_t r;
+	int timeout;
+
+	sv = x_malloc(sizeof(*sv));
+	memset(sv, 0, sizeof(*sv));
+	sv->sv_lfd = sv_listen(port, SOCK_STREAM);
+	sv->sv_ufd = sv_listen(port, SOCK_DGRAM);
+	signal(SIGPIPE, SIG_IGN);
+
+	sv->sv_eng = engine_create();
+	if (engine_configure(sv->sv_eng, rate, fmt, 0, owpm, cwpm, hz) != 0)
+		errx(1, "unable to build sounds");
+	in_open(&sv->sv_in, STDIN_FILENO, inbuf);
+	sv->sv_thresh = rate;
+	sv->sv_fmt = fmt;
+	sv->sv_blkframes = rate * SV_BLOCKMS / 1000;
+	sv->sv_blklen = sv->sv_blkframes * sf_bps[fmt];
+	sv->sv_ring = x_malloc(SV_NBLOCK * sv->sv_blklen);
+	sv->sv_dgram = x_malloc(SV_DGRAM);
+	if (type == OF_WAV) {
+		of_wavhdr(sv->sv_hdr, fmt, rate, 0);
+		sv->sv_hdrlen = OF_WAVHDR;
+	}
+	for (i = 0; i < SV_MAXCL; i++)
+		sv->sv_cl[i].cl_fd = -1;
+
+	blockns = (u_int64_t)sv->sv_blkframes * 1000000000 / rate;
+	t0 = mono_ns();
+	for (;;) {
+		sv_feed(sv);
+
+		/* render whatever the clock has come round to */
+		now = mono_ns();
+		due = (now - t0) / blockns + 1;
+		if (due - sv->sv_epoch > SV_NBLOCK) {
+			/* we were held up; pick up from here */
+			t0 = now - sv->sv_epoch * blockns;
+			due = sv->sv_epoch + 1;
+		}
+		while (sv->sv_epoch < due)
+			sv_render(sv);
+		for (i = 0; i < sv->sv_ncl; i++)
+			if (sv->sv_cl[i].cl_fd != -1)
+				sv_send(sv, &sv->sv_cl[i]);
+
+		pfd = sv->sv_pfd;
+		n = 0;
+		pfd[n].fd = sv->sv_lfd;
+		pfd[n++].events = POLLIN;
+		ufd = ifd = UINT_MAX;
+		if (sv->sv_doff == sv->sv_dlen) {
+			ufd = n;
+			pfd[n].fd = sv->sv_ufd;
+			pfd[n++].events = POLLIN;
+		}
+		if (!sv->sv_eof && !in_pending(&sv->sv_in) &&
+		    playlist_nsamps(&sv->sv_eng->e_ph) < sv->sv_thresh) {
+			ifd = n;
+			pfd[n].fd = sv->sv_in.ib_fd;
+			pfd[n++].events = POLLIN;
+		}
+		for (i = 0; i < sv->sv_ncl; i++) {
+			cl = &sv->sv_cl[i];
+			if (cl->cl_fd == -1 || (cl->cl_hdr == sv->sv_hdrlen &&
+			    cl->cl_epoch == sv->sv_epoch))
+				continue;
+			pfd[n].fd = cl->cl_fd;
+			pfd[n++].events = POLLOUT;
+		}
+		now = mono_ns();
+		timeout = t0 + due * blockns > now ?
+		    (t0 + due * blockns - now) / 1000000 + 1 : 0;
+		if (poll(pfd, n, timeout) == -1 && errno != EINTR)
+			err(1, "poll");
+
+		if (pfd[0].revents & POLLIN)
+			sv_accept(sv);
+		if (ufd != UINT_MAX && (pfd[ufd].revents & POLLIN)) {
+			r = recv(sv->sv_ufd, sv->sv_dgram, SV_DGRAM, 0);
+			if (r > 0) {
+				sv->sv_doff = 0;
+				sv->sv_dlen = r;
+			}
+		}
+		if (ifd != UINT_MAX &&
+		    (pfd[ifd].revents & (POLLIN | POLLHUP)) &&
+		    fetch_chars(&sv->sv_in, sv->sv_eng, sv->sv_thresh -
+		    playlist_nsamps(&sv->sv_eng->e_ph)))
+			sv->sv_eof = 1;
+	}
+}
+
+/*
+ * A nonblocking socket of type bound to port on every local address.
+ */
+int
+sv_listen(const char *port, int type)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd = -1, on = 1, e;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+	hints.ai_flags = AI_PASSIVE;
+	if ((e = getaddrinfo(NULL, port, &hints, &res)) != 0)
+		errx(1, "%s: %s", port, gai_strerror(e));
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		(void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on,
+		    sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    (type != SOCK_STREAM || listen(fd, 64) == 0))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1)
+		err(1, "%s", port);
+	freeaddrinfo(res);
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+	return (fd);
+}
+
+/*
+ * Take on new listeners, starting each at the next block.
+ */
+void
+sv_accept(struct server *sv)
+{
+	struct sv_client *cl;
+	u_int i;
+	int fd;
+
+	while ((fd = accept(sv->sv_lfd, NULL, NULL)) != -1) {
+		for (i = 0; i < SV_MAXCL; i++)
+			if (sv->sv_cl[i].cl_fd == -1)
+				break;
+		if (i == SV_MAXCL || fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+			close(fd);
+			continue;
+		}
+		cl = &sv->sv_cl[i];
+		cl->cl_fd = fd;
+		cl->cl_hdr = 0;
+		cl->cl_epoch = sv->sv_epoch;
+		cl->cl_off = 0;
+		if (i >= sv->sv_ncl)
+			sv->sv_ncl = i + 1;
+		if (diagmode > 0)
+			fprintf(stderr, "listener %u connected\n", i);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+	    errno != ECONNABORTED)
+		warn("accept");
+}
+
+/*
+ * Keep about sv_thresh samples queued, from a datagram if one is being
+ * queued, otherwise from text already read.
+ */
+void
+sv_feed(struct server *sv)
+{
+	struct engine *eng = sv->sv_eng;
+	u_int nsamps;
+
+	while ((nsamps = playlist_nsamps(&eng->e_ph)) < sv->sv_thresh &&
+	    playlist_nent(&eng->e_ph) < PL_RINGSIZE - 1) {
+		if (sv->sv_doff < sv->sv_dlen)
+			sv->sv_doff += engine_text(eng,
+			    sv->sv_dgram + sv->sv_doff,
+			    sv->sv_dlen - sv->sv_doff, sv->sv_thresh - nsamps);
+		else if (!sv->sv_eof && in_pending(&sv->sv_in)) {
+			if (fetch_chars(&sv->sv_in, eng,
+			    sv->sv_thresh - nsamps))
+				sv->sv_eof = 1;
+		} else
+			break;
+	}
+}
+
+/*
+ * The next block, in the slot whose listeners (if any are left) must go.
+ */
+void
+sv_render(struct server *sv)
+{
+	u_char *blk;
+	u_int i;
+
+	for (i = 0; i < sv->sv_ncl; i++)
+		if (sv->sv_cl[i].cl_fd != -1 &&
+		    sv->sv_cl[i].cl_epoch + SV_NBLOCK <= sv->sv_epoch)
+			sv_drop(sv, &sv->sv_cl[i], "too far behind");
+	blk = sv->sv_ring + (sv->sv_epoch % SV_NBLOCK) * sv->sv_blklen;
+	engine_render(sv->sv_eng, blk, sv->sv_blkframes, 1, NULL);
+#if BYTE_ORDER == BIG_ENDIAN
+	if (sv->sv_fmt != SF_F32) {
+		u_int bps = sf_bps[sv->sv_fmt], j;
+		u_char t;
+
+		for (i = 0; i < sv->sv_blklen; i += bps)
+			for (j = 0; j < bps / 2; j++) {
+				t = blk[i + j];
+				blk[i + j] = blk[i + bps - 1 - j];
+				blk[i + bps - 1 - j] = t;
+			}
+	}
+#endif
+	sv->sv_epoch++;
+}
+
+/*
+ * Send cl all it has to catch up on, or as much as the socket takes.
+ */
+void
+sv_send(struct server *sv, struct sv_client *cl)
+{
+	const u_char *p;
+	size_t len;
+	ssize_t r;
+
+	for (;;) {
+		if (cl->cl_hdr < sv->sv_hdrlen) {
+			p = sv->sv_hdr + cl->cl_hdr;
+			len = sv->sv_hdrlen - cl->cl_hdr;
+		} else if (cl->cl_epoch < sv->sv_epoch) {
+			p = sv->sv_ring + (cl->cl_epoch % SV_NBLOCK) *
+			    sv->sv_blklen + cl->cl_off;
+			len = sv->sv_blklen - cl->cl_off;
+		} else
+			return;
+		if ((r = write(cl->cl_fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				sv_drop(sv, cl, strerror(errno));
+			return;
+		}
+		if (cl->cl_hdr < sv->sv_hdrlen)
+			cl->cl_hdr += r;
+		else if ((cl->cl_off += r) == sv->sv_blklen) {
+			cl->cl_epoch++;
+			cl->cl_off = 0;
+		}
+	}
+}
+
+void
+sv_drop(struct server *sv, struct sv_client *cl, const char *why)
+{
+	if (diagmode > 0)
+		fprintf(stderr, "listener %u dropped: %s\n",
+		    (u_int)(cl - sv->sv_cl), why);
+	close(cl->cl_fd);
+	cl->cl_fd = -1;
+}
+
+/*
+ * Decode the text in the audio of file (the standard input for "-"), or
+ * with no file in that of the default audio input, printing it as it
+ * comes.  Files are WAV in whatever format and channels the header
+ * says, or raw samples of fmt in nch channels at rate.
+ */
+int
+dec_main(const char *file, u_int nch, int type, int fmt, u_int rate,
+    float owpm, float cwpm, float hz)
+{
+	struct decoder *dk;
+	u_int64_t left = ~(u_int64_t)0;
+	u_char *raw;
+	float *buf;
+	size_t have = 0, fsz, n;
+	ssize_t r;
+	int fd;
+
+	if (file == NULL)
+		return (dec_audio(nch, rate, owpm, cwpm, hz));
+	if (strcmp(file, "-") == 0)
+		fd = STDIN_FILENO;
+	else if ((fd = open(file, O_RDONLY)) == -1)
+		err(1, "%s", file);
+	if (type == OF_WAV && wav_read(fd, &fmt, &nch, &rate, &left) != 0)
+		errx(1, "%s: not a WAV file of 16 or 24 bit or float samples",
+		    file);
+	if (nch > DEC_MAXCH)
+		errx(1, "%s: more than %d channels", file, DEC_MAXCH);
+
+	dk = x_malloc(sizeof(*dk));
+	dec_init(dk, nch, rate, owpm, cwpm, hz);
+	fsz = sf_bps[fmt] * nch;
+	raw = x_malloc(DEC_FRAMES * fsz);
+	buf = x_malloc(DEC_FRAMES * nch * sizeof(float));
+	while ((n = DEC_FRAMES * fsz - have) > 0 && left > 0) {
+		if (n > left)
+			n = left;
+		if ((r = read(fd, raw + have, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "%s", file);
+		}
+		if (r == 0)
+			break;
+		have += r;
+		left -= r;
+		n = have / fsz;
+		get_samples(buf, fmt, raw, n * nch);
+		dec_feed(dk, buf, n);
+		have -= n * fsz;
+		memmove(raw, raw + n * fsz, have);
+	}
+	dec_end(dk);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	x_free(buf);
+	x_free(raw);
+	x_free(dk);
+	return (0);
+}
+
+/*
+ * The same from the default audio input, which is read (blocking) in
+ * float until the program is killed.
+ */
+int
+dec_audio(u_int nch, u_int rate, float owpm, float cwpm, float hz)
+{
+	struct decoder *dk;
+	PaStreamParameters ip;
+	PaStream *stream;
+	PaError error;
+	u_long lost = 0;
+	float *buf;
+
+	if ((error = Pa_Initialize()) != paNoError)
+		errx(1, "portaudio: %s", Pa_GetErrorText(error));
+	if ((ip.device = Pa_GetDefaultInputDevice()) == paNoDevice)
+		errx(1, "portaudio: no default input device");
+	ip.channelCount = nch;
+	ip.sampleFormat = paFloat32;
+	ip.suggestedLatency =
+	    Pa_GetDeviceInfo(ip.device)->defaultHighInputLatency;
+	ip.hostApiSpecificStreamInfo = NULL;
+	error = Pa_OpenStream(&stream, &ip, NULL, rate, DEC_FRAMES, paNoFlag,
+	    NULL, NULL);
+	if (error != paNoError)
+		errx(1, "portaudio: OpenStream: %s", Pa_GetErrorText(error));
+	if ((error = Pa_StartStream(stream)) != paNoError)
+		errx(1, "portaudio: StartStream: %s", Pa_GetErrorText(error));
+
+	dk = x_malloc(sizeof(*dk));
+	dec_init(dk, nch, rate, owpm, cwpm, hz);
+	buf = x_malloc(DEC_FRAMES * nch * sizeof(float));
+	for (;;) {
+		error = Pa_ReadStream(stream, buf, DEC_FRAMES);
+		if (error == paInputOverflowed) {
+			if (lost++ == 0)
+				warnx("portaudio: input overflowed, "
+				    "audio was lost");
+		} else if (error != paNoError)
+			errx(1, "portaudio: ReadStream: %s",
+			    Pa_GetErrorText(error));
+		dec_feed(dk, buf, DEC_FRAMES);
+	}
+}
+
+/*
+ * Work the block size and the thresholds out from the lengths of the
+ * sound set that would be played at these rates.  Its dit and dah are
+ * a dit and three each followed by a dit of space; a character then
+ * has ss_inCharlen more space, and a word ss_inWordlen more than that.
+ * Spaces are told apart halfway between.
+ */
+void
+dec_init(struct decoder *dk, u_int nch, u_int rate, float owpm, float cwpm,
+    float hz)
+{
+	struct sound_set ss;
+	float u, cg, wg;
+	u_int c, i, n;
+
+	memset(dk, 0, sizeof(*dk));
+	init_sounds(&ss, rate, SF_F32, 0, owpm, cwpm, hz);
+	u = ss.ss_ditlen / 2.0;
+	cg = (u + ss.ss_inCharlen) / u;
+	wg = cg + ss.ss_inWordlen / u;
+	dk->dk_charth = (1.0 + cg) / 2.0;
+	dk->dk_wordth = (cg + wg) / 2.0;
+	dk->dk_idle = 2.0 * wg;
+
+	dk->dk_nch = nch;
+	dk->dk_block = u / DEC_BPU;
+	if (dk->dk_block < 16)
+		dk->dk_block = 16;
+	dk->dk_unit = u / dk->dk_block;
+	dk->dk_coeff = 2.0 * cos(2.0 * M_PI * hz / rate);
+	dk->dk_decay = expf(-(float)dk->dk_block / (2.0f * rate));
+
+	for (i = 0; i < sizeof(dk->dk_bycode) / sizeof(dk->dk_bycode[0]); i++)
+		dk->dk_bycode[i] = -1;
+	for (i = 0; i < nmorse; i++)
+		if ((n = MC_LEN(morse_code[i])) <= 8)
+			dk->dk_bycode[1 << n | (morse_code[i] & 0xff)] = i;
+	for (c = 0; c < nch; c++) {
+		dk->dk_ch[c].dc_unit = dk->dk_unit;
+		dk->dk_ch[c].dc_gap = DG_LINE;
+	}
+}
+
+/*
+ * Run all the channels' filters over n interleaved frames of x.
+ */
+void
+dec_feed(struct decoder *dk, const float *x, u_int frames)
+{
+	float s1, s2, p, norm;
+	u_int n, c;
+
+	/* a full scale tone comes out as 1 */
+	norm = 4.0f / ((float)dk->dk_block * dk->dk_block);
+	while (frames > 0) {
+		n = dk->dk_block - dk->dk_n;
+		if (n > frames)
+			n = frames;
+		goertzel(dk->dk_s1, dk->dk_s2, x, n, dk->dk_nch,
+		    dk->dk_coeff);
+		x += n * dk->dk_nch;
+		frames -= n;
+		if ((dk->dk_n += n) < dk->dk_block)
+			break;
+		for (c = 0; c < dk->dk_nch; c++) {
+			s1 = dk->dk_s1[c];
+			s2 = dk->dk_s2[c];
+			p = (s1 * s1 + s2 * s2 - dk->dk_coeff * s1 * s2) * norm;
+			dk->dk_s1[c] = dk->dk_s2[c] = 0.0;
+			dec_block(dk, c, p);
+		}
+		dk->dk_n = 0;
+	}
+}
+
+/*
+ * s = x + coeff * s1 - s2 for each of nch channels, over n frames of x.
+ * The channels are independent, so they go four to a vector; each
+ * lane's arithmetic is that of the plain loop.
+ */
+void
+goertzel(float *s1, float *s2, const float *x, u_int n, u_int nch,
+    float coeff)
+{
+	u_int c = 0, i;
+	float a, b, t;
+
+#if defined(__SSE__)
+	__m128 k = _mm_set1_ps(coeff), va, vb, vt;
+
+	for (; c + 4 <= nch; c += 4) {
+		va = _mm_loadu_ps(s1 + c);
+		vb = _mm_loadu_ps(s2 + c);
+		for (i = 0; i < n; i++) {
+			vt = _mm_add_ps(_mm_loadu_ps(x + i * nch + c),
+			    _mm_sub_ps(_mm_mul_ps(k, va), vb));
+			vb = va;
+			va = vt;
+		}
+		_mm_storeu_ps(s1 + c, va);
+		_mm_storeu_ps(s2 + c, vb);
+	}
+#elif defined(__ARM_NEON)
+	float32x4_t k = vdupq_n_f32(coeff), va, vb, vt;
+
+	for (; c + 4 <= nch; c += 4) {
+		va = vld1q_f32(s1 + c);
+		vb = vld1q_f32(s2 + c);
+		for (i = 0; i < n; i++) {
+			vt = vaddq_f32(vld1q_f32(x + i * nch + c),
+			    vsubq_f32(vmulq_f32(k, va), vb));
+			vb = va;
+			va = vt;
+		}
+		vst1q_f32(s1 + c, va);
+		vst1q_f32(s2 + c, vb);
+	}
+#endif
+	for (; c < nch; c++) {
+		a = s1[c];
+		b = s2[c];
+		for (i = 0; i < n; i++) {
+			t = x[i * nch + c] + (coeff * a - b);
+			b = a;
+			a = t;
+		}
+		s1[c] = a;
+		s2[c] = b;
+	}
+}
+
+/*
+ * One block's power p in channel c: mark or space?  A tone is within
+ * 6dB of the loudest lately and well clear of the noise, and it only
+ * starts or stops once that has lasted two blocks, so that a click or a
+ * dropout is not taken for an element.  Spaces are acted on as they
+ * grow, so a character is out as soon as its space is long enough.
+ */
+void
+dec_block(struct decoder *dk, u_int c, float p)
+{
+	struct dec_chan *dc = &dk->dk_ch[c];
+	u_int len;
+	int on;
+
+	if (p > dc->dc_peak)
+		dc->dc_peak = p;
+	else
+		dc->dc_peak *= dk->dk_decay;
+	on = p > DEC_MINPOW && p > 0.25f * dc->dc_peak &&
+	    p > 8.0f * dc->dc_floor;
+	/* the noise is what is in a space, away from the marks either side */
+	if (!on && !dc->dc_mark && dc->dc_run > 2)
+		dc->dc_floor += (p - dc->dc_floor) * 0.05f;
+
+	if (on == dc->dc_mark) {
+		dc->dc_run += dc->dc_flip + 1;
+		dc->dc_flip = 0;
+	} else if (++dc->dc_flip == 2) {
+		len = dc->dc_run;
+		dc->dc_run = dc->dc_flip;
+		dc->dc_flip = 0;
+		dc->dc_mark = on;
+		if (!on)
+			dec_mark(dk, dc, len);
+	}
+	if (dc->dc_mark)
+		return;
+
+	if (dc->dc_gap == DG_NONE &&
+	    dc->dc_run > dk->dk_charth * dc->dc_unit) {
+		dec_char(dk, c);
+		dc->dc_gap = DG_CHAR;
+	}
+	if (dc->dc_gap == DG_CHAR &&
+	    dc->dc_run > dk->dk_wordth * dc->dc_unit) {
+		dc->dc_space = 1;
+		dc->dc_gap = DG_WORD;
+	}
+	if (dc->dc_gap == DG_WORD &&
+	    dc->dc_run > dk->dk_idle * dc->dc_unit) {
+		dec_flush(dk, c);
+		dc->dc_space = 0;
+		dc->dc_gap = DG_LINE;
+	}
+}
+
+/*
+ * A mark of len blocks has ended: a dit or a dah, by the dit length
+ * so far, which then moves a quarter of the way toward it.  That keeps
+ * the spaces right; the mark itself is only settled with the rest of
+ * its character.
+ */
+void
+dec_mark(struct decoder *dk, struct dec_chan *dc, u_int len)
+{
+	int dah;
+
+	dah = len >= 2.0f * dc->dc_unit;
+	dc->dc_unit += ((dah ? len / 3.0f : len) - dc->dc_unit) * 0.25f;
+	if (dc->dc_unit < dk->dk_unit / 4.0f)
+		dc->dc_unit = dk->dk_unit / 4.0f;
+	else if (dc->dc_unit > dk->dk_unit * 4.0f)
+		dc->dc_unit = dk->dk_unit * 4.0f;
+	if (dc->dc_nel < MC_MAXEL)
+		dc->dc_el[dc->dc_nel] = len;
+	if (dc->dc_nel <= MC_MAXEL)
+		dc->dc_nel++;		/* one too many matches nothing */
+	dc->dc_gap = DG_NONE;
+}
+
+/*
+ * The marks so far make a character: put it out, or "_" if it is not
+ * one in the table.  A character with both dits and dahs in it splits
+ * them by itself, halfway between its shortest and longest, which gets
+ * it right while the dit length is still catching up with the sender.
+ */
+void
+dec_char(struct decoder *dk, u_int c)
+{
+	struct dec_chan *dc = &dk->dk_ch[c];
+	u_int n = dc->dc_nel, code, lo, hi, i;
+	float split;
+	int m = -1;
+
+	dc->dc_nel = 0;
+	if (n == 0)
+		return;
+	code = n << 16;
+	if (n <= MC_MAXEL) {
+		lo = hi = dc->dc_el[0];
+		for (i = 1; i < n; i++)
+			if (dc->dc_el[i] < lo)
+				lo = dc->dc_el[i];
+			else if (dc->dc_el[i] > hi)
+				hi = dc->dc_el[i];
+		split = hi >= 2 * lo ? (lo + hi) / 2.0f : 2.0f * dc->dc_unit;
+		for (i = 0; i < n; i++)
+			if (dc->dc_el[i] >= split)
+				code |= 1 << i;
+	}
+	if (n <= 8)
+		m = dk->dk_bycode[1 << n | (code & 0xff)];
+	else
+		for (i = 0; i < nmorse && m == -1; i++)
+			if (morse_code[i] == code)
+				m = i;
+	if (dc->dc_space)
+		dec_put(dk, c, " ");
+	dc->dc_space = 0;
+	dec_put(dk, c, m >= 0 ? morse_name[m] : "_");
+}
+
+/*
+ * Text for channel c.  A lone channel's goes straight out; with more,
+ * each keeps a line of its own until it goes quiet.
+ */
+void
+dec_put(struct decoder *dk, u_int c, const char *s)
+{
+	struct dec_chan *dc = &dk->dk_ch[c];
+	size_t n = strlen(s);
+
+	if (dk->dk_nch == 1) {
+		fputs(s, stdout);
+		fflush(stdout);
+		dc->dc_len += n;
+		return;
+	}
+	if (dc->dc_len + n > DEC_LINE)
+		dec_flush(dk, c);
+	memcpy(dc->dc_line + dc->dc_len, s, n);
+	dc->dc_len += n;
+}
+
+void
+dec_flush(struct decoder *dk, u_int c)
+{
+	struct dec_chan *dc = &dk->dk_ch[c];
+
+	if (dc->dc_len == 0)
+		return;
+	if (dk->dk_nch == 1)
+		putchar('\n');
+	else
+		printf("%u: %.*s\n", c + 1, (int)dc->dc_len, dc->dc_line);
+	fflush(stdout);
+	dc->dc_len = 0;
+}
+
+/*
+ * The input has run out: whatever is left is the last character.
+ */
+void
+dec_end(struct decoder *dk)
+{
+	u_int c;
+
+	for (c = 0; c < dk->dk_nch; c++) {
+		dec_char(dk, c);
+		dec_flush(dk, c);
+	}
+}
+
+#define	GET16(p)	((p)[0] | (p)[1] << 8)
+#define	GET32(p)	((u_int32_t)GET16(p) | (u_int32_t)GET16((p) + 2) << 16)
+
+/*
+ * Read a WAV header, up to the samples.  *left is set to how many bytes
+ * of them there are, unless the header does not know (as when
+ * of_wavhdr() wrote it to a pipe).
+ */
+int
+wav_read(int fd, int *fmt, u_int *nch, u_int *rate, u_int64_t *left)
+{
+	u_char h[48];
+	u_int32_t len, n;
+	u_int tag = 0, bits = 0;
+
+	if (read_all(fd, h, 12) != 0 || memcmp(h, "RIFF", 4) != 0 ||
+	    memcmp(h + 8, "WAVE", 4) != 0)
+		return (-1);
+	for (;;) {
+		if (read_all(fd, h, 8) != 0)
+			return (-1);
+		len = GET32(h + 4);
+		if (memcmp(h, "data", 4) == 0)
+			break;
+		if (memcmp(h, "fmt ", 4) == 0) {
+			if (len < 16 || len > 40 ||
+			    read_all(fd, h, len + (len & 1)) != 0)
+				return (-1);
+			tag = GET16(h);
+			*nch = GET16(h + 2);
+			*rate = GET32(h + 4);
+			bits = GET16(h + 14);
+			if (tag == 0xfffe && len >= 26)	/* extensible */
+				tag = GET16(h + 24);
+			continue;
+		}
+		for (len += len & 1; len > 0; len -= n) {
+			n = len < sizeof(h) ? len : sizeof(h);
+			if (read_all(fd, h, n) != 0)
+				return (-1);
+		}
+	}
+	if (tag == 1 && bits == 16)
+		*fmt = SF_S16;
+	else if (tag == 1 && bits == 24)
+		*fmt = SF_S24;
+	else if (tag == 3 && bits == 32)
+		*fmt = SF_F32;
+	else
+		return (-1);
+	if (*nch == 0 || *rate < 1000)
+		return (-1);
+	if (len != 0 && len < 0xffffffff - OF_WAVHDR)
+		*left = len;
+	return (0);
 }
 
 int
-build_sounds(struct s_params *pars)
+read_all(int fd, void *buf, size_t len)
 {
-	int r;
+	ssize_t r;
 
-	if ((r = build_dit(&dit, pars)) != 0) {
-		destroy_sounds();
-		return (r);
-	}
-	if ((r = build_dah(&dah, pars)) != 0) {
-		destroy_sounds();
-		return (r);
-	}
-	if ((r = build_inChar(&inChar, pars)) != 0) {
-		destroy_sounds();
-		return (r);
-	}
-	if ((r = build_inWord(&inWord, pars)) != 0) {
-		destroy_sounds();
-		return (r);
-	}
-	if ((r = build_quiet(&quietBlock, pars)) != 0) {
-		destroy_sounds();
-		return (r);
+	while (len > 0) {
+		if ((r = read(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "read");
+		}
+		if (r == 0)
+			return (-1);
+		buf = (u_char *)buf + r;
+		len -= r;
 	}
 	return (0);
 }
 
-void
-time_check(struct s_params *pars)
+/*
+ * Parse a voice: "file[,wpm[,cwpm[,freq[,gain[,pan]]]]]".  Empty fields
+ * take the defaults; pan runs from -1 (left) to 1 (right).  A gain of -1
+ * means "not given" to the caller.
+ */
+int
+voice_parse(struct voice *v, char *spec, float owpm, float cwpm, float hz)
 {
-	float sampmin;
-	float perword, e, m;
+	char *fld[6], *p = spec;
+	float gain = -1.0, pan = 0.0, a;
+	u_int nf;
 
-	perword = 0;
-	perword += 10 * dit.len;
-	perword += 4 * dah.len;
-	perword += 5 * inChar.len;
-	perword += 1 * inWord.len;
-	
-	sampmin = (float)pars->sp_rate * 60.0;
-	m = sampmin/perword;
-	e = (fabs(m - overallwpm)/overallwpm) * 100;
-	if (e > 1.0) {
-		printf("dit %u dah %u inChar %u inWord %u\n",
-		    dit.len, dah.len, inChar.len, inWord.len);
-		printf("sampmin %f / perword %f = %f wpm (target %f), "
-		    "error %.2f%%\n", sampmin, perword, m, overallwpm, e);
+	for (nf = 0; nf < 6 && (fld[nf] = strsep(&p, ",")) != NULL; nf++)
+		;
+	if (p != NULL || fld[0][0] == '\0')
+		return (-1);
+	if (nf > 1 && fld[1][0] != '\0') {
+		cwpm = -1.0;
+		if (getfloat(fld[1], &owpm) || owpm < 1.0 || owpm > 70.0)
+			return (-1);
 	}
-}
-
-void
-test_times(struct s_params *pars)
-{
-	float c, o, maxwpm = 100.0;
-	double old_owpm, old_cwpm;
-
-	old_owpm = overallwpm;
-	old_cwpm = charwpm;
-	init_sounds();
-	for (o = 1.0; o <= maxwpm; o++) {
-		for (c = o; c <= maxwpm; c++) {
-			overallwpm = o;
-			charwpm = c;
-			build_sounds(pars);
-			time_check(pars);
-			destroy_sounds();
-		}
+	if (nf > 2 && fld[2][0] != '\0' &&
+	    (getfloat(fld[2], &cwpm) || cwpm < 1.0 || cwpm > 70.0))
+		return (-1);
+	if (nf > 3 && fld[3][0] != '\0' &&
+	    (getfloat(fld[3], &hz) || hz < 1.0 || hz > 20000.0))
+		return (-1);
+	if (nf > 4 && fld[4][0] != '\0' &&
+	    (getfloat(fld[4], &gain) || gain > 1.0))
+		return (-1);
+	if (nf > 5 && fld[5][0] != '\0') {
+		/* getfloat() only takes positive numbers */
+		if (getfloat(fld[5][0] == '-' ? fld[5] + 1 : fld[5], &pan) ||
+		    pan > 1.0)
+			return (-1);
+		if (fld[5][0] == '-')
+			pan = -pan;
 	}
-	overallwpm = old_owpm;
-	charwpm = old_cwpm;
+	if (pick_rates(&owpm, &cwpm) != 0)
+		return (-1);
+
+	if (strcmp(fld[0], "-") == 0)
+		v->v_fd = fileno(stdin);
+	else if ((v->v_fd = open(fld[0], O_RDONLY)) == -1)
+		err(1, "%s", fld[0]);
+	v->v_eng = NULL;
+	v->v_eof = 0;
+	v->v_mix = 1;
+	v->v_owpm = owpm;
+	v->v_cwpm = cwpm;
+	v->v_hz = hz;
+	/* constant power pan; the gain is filled in later if not given */
+	a = (pan + 1.0) * M_PI / 4.0;
+	v->v_gain[0] = cosf(a);
+	v->v_gain[1] = sinf(a);
+	if (gain != -1.0) {
+		v->v_gain[0] *= gain;
+		v->v_gain[1] *= gain;
+	} else
+		v->v_mix = -1;
+	return (0);
 }
 
 int
-getfloat(const char *s, float *fp)
+getnum(const char *s, long min, long max, long *lp)
 {
 	char *ep;
-	double d;
+	long l;
 
 	errno = 0;
-	d = strtod(s, &ep);
-	if (s[0] == '\0' || *ep != '\0')
-		return (-1);
-	if (errno == ERANGE && (d = HUGE_VAL || d == -HUGE_VAL))
-		return (-1);
-	if (d > FLT_MAX || d < FLT_MIN || isnan(d) || isinf(d))
+	l = strtol(s, &ep, 10);
+	if (s[0] == '\0' || *ep != '\0' || errno == ERANGE || l < min ||
+	    l > max)
 		return (-1);
-	*fp = (float)d;
+	*lp = l;
 	return (0);
 }
 
@@ -643,11 +5397,25 @@ int
 main(int argc, char *argv[])
 {
 	struct s_params pars;
-	int c;
+	int c, otype = OF_WAV, fmt = -1, tfmt = -1;
 	PaError error;
 	float cwpm = -1.0, owpm = -1.0, pitch = -1.0;
+	const char *ofile = NULL, *blist = NULL, *btext = NULL;
+	const char *sport = NULL, *table = NULL, *dfile = NULL;
+	char *vspecs[MAXVOICES], *p;
+	u_int njobs = 0, ahead = 0, i;
+	long l;
+	PaStreamParameters op;
+	struct sigaction sa;
+	float latency = -1.0, vstep = 0.0;
+	int keyer = 0, seekable = 0, decode = 0, chans = 0;
 
-	while ((c = getopt(argc, argv, "c:d:f:w:D")) != EOF) {
+	memset(&pars, 0, sizeof(pars));
+	pars.sp_inbuf = IN_MAXBUF;
+	pars.sp_rate = 44100;
+	pars.sp_chans = 2;
+	while ((c = getopt(argc, argv, "Aa:B:b:C:c:d:E:F:f:I:j:K:klL:m:o:"
+	    "P:R:r:S:s:Tt:u:V:w:x:D")) != EOF) {
 		switch (c) {
 		case 'c':
 			if (getfloat(optarg, &cwpm) ||
@@ -673,59 +5441,362 @@ main(int argc, char *argv[])
 				return (1);
 			}
 			break;
+		case 'A':
+			decode = 1;
+			dfile = NULL;
+			break;
+		case 'a':
+			if (getnum(optarg, 2, RQ_MAXBLK, &l)) {
+				fprintf(stderr, "%s: invalid number of blocks "
+				    "%s (2 <= n <= %d)\n", argv[0], optarg,
+				    RQ_MAXBLK);
+				return (1);
+			}
+			ahead = l;
+			break;
+		case 'B':
+			if (getnum(optarg, 16, 65536, &l)) {
+				fprintf(stderr, "%s: invalid block size %s "
+				    "(16 <= n <= 65536)\n", argv[0], optarg);
+				return (1);
+			}
+			pars.sp_blocksize = l;
+			break;
+		case 'b':
+			blist = optarg;
+			break;
+		case 'C':
+			if (getnum(optarg, 1, DEC_MAXCH, &l)) {
+				fprintf(stderr, "%s: invalid channel count %s "
+				    "(1 <= n <= %d)\n", argv[0], optarg,
+				    DEC_MAXCH);
+				return (1);
+			}
+			chans = l;
+			break;
+		case 'E':
+			if ((p = strchr(optarg, ',')) != NULL) {
+				*p++ = '\0';
+				if (getfloat(p, &env_ms) || env_ms > 50.0) {
+					fprintf(stderr, "%s: invalid edge "
+					    "length %s (0 < ms <= 50)\n",
+					    argv[0], p);
+					return (1);
+				}
+			}
+			for (env_shape = 0; env_shape < ENV_NSHAPE; env_shape++)
+				if (strcmp(optarg, env_name[env_shape]) == 0)
+					break;
+			if (env_shape == ENV_NSHAPE) {
+				fprintf(stderr, "%s: invalid edge shape %s "
+				    "(exp, cos, bh)\n", argv[0], optarg);
+				return (1);
+			}
+			break;
+		case 'F':
+			for (fmt = 0; fmt < SF_NFMT; fmt++)
+				if (strcmp(optarg, sf_name[fmt]) == 0)
+					break;
+			if (fmt == SF_NFMT) {
+				fprintf(stderr, "%s: invalid sample format %s "
+				    "(f32, s16, s24)\n", argv[0], optarg);
+				return (1);
+			}
+			break;
+		case 'I':
+			if (getnum(optarg, 1, 1024 * 1024, &l)) {
+				fprintf(stderr, "%s: invalid input buffer "
+				    "size %s (1 <= k <= 1048576)\n", argv[0],
+				    optarg);
+				return (1);
+			}
+			pars.sp_inbuf = (size_t)l * 1024;
+			break;
+		case 'j':
+			if (getnum(optarg, 1, 1024, &l)) {
+				fprintf(stderr, "%s: invalid job count %s "
+				    "(1 <= j <= 1024)\n", argv[0], optarg);
+				return (1);
+			}
+			njobs = l;
+			break;
+		case 'K':
+			sound_bank = optarg;
+			break;
+		case 'k':
+			keyer = 1;
+			break;
+		case 'l':
+			pars.sp_rt = 1;
+			break;
+		case 'L':
+			if (getfloat(optarg, &latency) || latency > 2000.0) {
+				fprintf(stderr, "%s: invalid latency %s "
+				    "(0 < ms <= 2000)\n", argv[0], optarg);
+				return (1);
+			}
+			break;
+		case 'm':
+			if (pars.sp_nvoices == MAXVOICES) {
+				fprintf(stderr, "%s: too many voices "
+				    "(max %d)\n", argv[0], MAXVOICES);
+				return (1);
+			}
+			vspecs[pars.sp_nvoices++] = optarg;
+			break;
+		case 'o':
+			ofile = optarg;
+			break;
+		case 'P':
+			btext = optarg;
+			break;
+		case 'R':
+			decode = 1;
+			dfile = optarg;
+			break;
+		case 'r':
+			if (getnum(optarg, 8000, 192000, &l)) {
+				fprintf(stderr, "%s: invalid sample rate %s "
+				    "(8000 <= r <= 192000)\n", argv[0], optarg);
+				return (1);
+			}
+			pars.sp_rate = l;
+			break;
+		case 'S':
+			if (getfloat(optarg, &pars.sp_statint) ||
+			    pars.sp_statint < 0.1 || pars.sp_statint > 3600.0) {
+				fprintf(stderr, "%s: invalid report interval "
+				    "%s (0.1 <= s <= 3600)\n", argv[0], optarg);
+				return (1);
+			}
+			break;
+		case 's':
+			sport = optarg;
+			break;
+		case 'T':
+			seekable = 1;
+			break;
+		case 't':
+			/* anything but wav is raw samples of that format */
+			otype = OF_RAW;
+			for (tfmt = 0; tfmt < SF_NFMT; tfmt++)
+				if (strcmp(optarg, sf_name[tfmt]) == 0)
+					break;
+			if (strcmp(optarg, "wav") == 0) {
+				otype = OF_WAV;
+				tfmt = -1;
+			} else if (tfmt == SF_NFMT) {
+				fprintf(stderr, "%s: invalid output type %s "
+				    "(wav, f32, s16, s24)\n", argv[0], optarg);
+				return (1);
+			}
+			break;
+		case 'u':
+			table = optarg;
+			break;
+		case 'V':
+			if (getfloat(optarg, &vstep) || vstep < 0.01 ||
+			    vstep > 10.0) {
+				fprintf(stderr, "%s: invalid grid step %s "
+				    "(0.01 <= s <= 10)\n", argv[0], optarg);
+				return (1);
+			}
+			break;
+		case 'x':
+			pars.sp_ctl = optarg;
+			break;
 		case 'D':
 			diagmode++;
 			break;
 		case '?':
 		default:
 			fprintf(stderr, "%s [-d /dev/audio] [-c cwpm] "
-			    "[-w owpm] [-f freq] [-D]\n", argv[0]);
+			    "[-w owpm] [-f freq] [-I kbytes] [-m voice ...] "
+			    "[-kl] [-a blocks] [-B frames] [-L ms] [-r rate] "
+			    "[-C chans] [-F format] [-E shape[,ms]] [-K bank] "
+			    "[-x control] [-T] [-S secs] [-u table] "
+			    "[-o file | -b list [-j jobs] | -s port] "
+			    "[-t type] [-V step [-j jobs]] [-P text] "
+			    "[-R file | -A] [-D]\n",
+			    argv[0]);
 			return (1);
 		}
 	}
 
 	if (pitch == -1.0)
 		pitch = 720.0;
-	pars.sp_hz = pitch;
 
-	if (owpm == -1.0 && cwpm == -1.0) {
-		/* Neither specified, assume Element 1 rates */
-		owpm = 5.0;
-		cwpm = 18.0;
-	} else if (cwpm == -1.0) {
-		/* Overall set, assume ARRL Farnsworth rules */
-		if (owpm > 18.0)
-			cwpm = owpm;
-		else
-			cwpm = 18.0;
-	} else if (owpm == -1.0) {
-		/* Character set, assume overall == cwpm */
-		owpm = cwpm;
+	if (sound_bank != NULL && mkdir(sound_bank, 0777) == -1 &&
+	    errno != EEXIST)
+		err(1, "%s", sound_bank);
+
+	build_lut();
+	if (table != NULL)
+		load_table(table);
+
+	if (pick_rates(&owpm, &cwpm) != 0) {
+		fprintf(stderr, "%s: character rate %f < "
+		    "overall rate %f\n", argv[0], cwpm, owpm);
+		return (1);
+	}
+
+	/*
+	 * Files are 16 bit unless the type or -F says otherwise; the sound
+	 * card gets float unless -F says otherwise.
+	 */
+	if (tfmt == -1)
+		tfmt = fmt == -1 ? SF_S16 : fmt;
+	pars.sp_fmt = fmt == -1 ? SF_F32 : fmt;
+
+	/* one channel to decode unless -C says, two to play */
+	if (decode)
+		return (dec_main(dfile, chans == 0 ? 1 : chans, otype, tfmt,
+		    pars.sp_rate, owpm, cwpm, pitch));
+	if (chans > 2) {
+		fprintf(stderr, "%s: invalid channel count %d (1 or 2 to "
+		    "play)\n", argv[0], chans);
+		return (1);
+	}
+	if (chans != 0)
+		pars.sp_chans = chans;
+
+	if (btext != NULL)
+		return (bench_main(&pars, btext));
+
+	if (vstep > 0.0)
+		return (test_times(pars.sp_rate, vstep, njobs, 1) != 0);
+
+	if (sport != NULL)
+		return (server_main(sport, otype, tfmt, pars.sp_rate,
+		    pars.sp_inbuf, owpm, cwpm, pitch));
+
+	if (blist != NULL)
+		return (batch_main(blist, njobs, otype, tfmt, pars.sp_rate,
+		    pars.sp_inbuf, owpm, cwpm, pitch));
+
+	if (ofile != NULL) {
+		struct out_file *of;
+		int fd;
+
+		if (strcmp(ofile, "-") == 0)
+			fd = STDOUT_FILENO;
+		else if ((fd = open(ofile, O_WRONLY | O_CREAT | O_TRUNC,
+		    0666)) == -1)
+			err(1, "%s", ofile);
+		of = x_malloc(sizeof(*of));
+		pars.sp_sampthresh = pars.sp_rate;
+		pars.sp_out = of;
+		of_open(of, fd, otype, tfmt, pars.sp_rate);
+
+		pars.sp_eng = engine_create();
+		if (engine_configure(pars.sp_eng, pars.sp_rate, tfmt, 0, owpm,
+		    cwpm, pitch) != 0)
+			errx(1, "unable to build sounds");
+		file_loop(&pars, fileno(stdin));
+		of_close(of);
+		engine_destroy(pars.sp_eng);
+		x_free(of);
+		return (0);
+	}
+
+	if (pars.sp_nvoices == 0) {
+		/* just stdin, played as is */
+		pars.sp_voices = x_malloc(sizeof(*pars.sp_voices));
+		pars.sp_voices->v_fd = fileno(stdin);
+		pars.sp_voices->v_eof = 0;
+		pars.sp_voices->v_mix = 0;
+		pars.sp_voices->v_owpm = owpm;
+		pars.sp_voices->v_cwpm = cwpm;
+		pars.sp_voices->v_hz = pitch;
+		pars.sp_nvoices = 1;
 	} else {
-		/* both set, ensure sanity */
-		if (owpm > cwpm) {
-			fprintf(stderr, "%s: character rate %f < "
-			    "overall rate %f\n", argv[0], cwpm, owpm);
-			return (1);
+		pars.sp_voices = x_malloc(pars.sp_nvoices *
+		    sizeof(*pars.sp_voices));
+		for (i = 0; i < pars.sp_nvoices; i++) {
+			struct voice *v = &pars.sp_voices[i];
+
+			if (voice_parse(v, vspecs[i], owpm, cwpm,
+			    pitch) != 0) {
+				fprintf(stderr, "%s: invalid voice %s\n",
+				    argv[0], vspecs[i]);
+				return (1);
+			}
+			/* share the headroom among voices without a gain */
+			if (v->v_mix == -1) {
+				v->v_gain[0] /= pars.sp_nvoices;
+				v->v_gain[1] /= pars.sp_nvoices;
+				v->v_mix = 1;
+			}
 		}
 	}
-	overallwpm = owpm;
-	charwpm = cwpm;
+
+	if (keyer && pars.sp_blocksize == 0)
+		pars.sp_blocksize = KEYER_FRAMES;
 
 	error = Pa_Initialize();
 	if (error != paNoError)
 		err(1, "portaudio: %s", Pa_GetErrorText(error));
 
-	pars.sp_rate = 44100;
 	pars.sp_sampthresh = pars.sp_rate;
-	error = Pa_OpenDefaultStream(&pars.sp_stream,
-				     0, /* no input */
-				     2, /* stereo output */
-				     paFloat32, /* float output */
-				     pars.sp_rate, /* sample rate */
-				     paFramesPerBufferUnspecified,
-				     mp_callback,
-				     NULL);
+	pars.sp_lowat = pars.sp_sampthresh / 2;
+	if (pipe(pars.sp_wakefd) == -1)
+		err(1, "pipe");
+	for (i = 0; i < 2; i++)
+		if (fcntl(pars.sp_wakefd[i], F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl");
+	stats_init(&pars.sp_stats);
+	pars.sp_rtcpu = -1;
+	if (pars.sp_rt) {
+		/* before any sounds are made, or threads started */
+		lock_stats = &pars.sp_stats;
+		rt_init(&pars);
+		mem_lock(&pars, sizeof(pars));
+		mem_lock(pars.sp_voices,
+		    pars.sp_nvoices * sizeof(*pars.sp_voices));
+	}
+	for (i = 0; i < pars.sp_nvoices; i++) {
+		atomic_init(&pars.sp_voices[i].v_wait, 0);
+		pars.sp_voices[i].v_eng = engine_create();
+		pars.sp_voices[i].v_eng->e_stats = &pars.sp_stats;
+		/* the play list ring is in here */
+		mem_lock(pars.sp_voices[i].v_eng, sizeof(struct engine));
+		in_open(&pars.sp_voices[i].v_in, pars.sp_voices[i].v_fd,
+		    pars.sp_inbuf);
+	}
+	if ((op.device = Pa_GetDefaultOutputDevice()) == paNoDevice)
+		errx(1, "portaudio: no default output device");
+	op.channelCount = pars.sp_chans;
+	switch (pars.sp_fmt) {
+	case SF_S16:
+		op.sampleFormat = paInt16;
+		break;
+	case SF_S24:
+		op.sampleFormat = paInt24;
+		break;
+	default:
+		op.sampleFormat = paFloat32;
+		break;
+	}
+	op.hostApiSpecificStreamInfo = NULL;
+	if (latency >= 0.0)
+		op.suggestedLatency = latency / 1000.0;
+	else if (keyer)
+		op.suggestedLatency =
+		    Pa_GetDeviceInfo(op.device)->defaultLowOutputLatency;
+	else {
+		/* what Pa_OpenDefaultStream() would pick */
+		op.suggestedLatency =
+		    Pa_GetDeviceInfo(op.device)->defaultHighOutputLatency;
+	}
+	error = Pa_OpenStream(&pars.sp_stream,
+			      NULL, /* no input */
+			      &op,
+			      pars.sp_rate, /* sample rate */
+			      pars.sp_blocksize ? pars.sp_blocksize :
+			      paFramesPerBufferUnspecified,
+			      paNoFlag,
+			      mp_callback,
+			      &pars);
 	if (error != paNoError) {
 		warn("portaudio: %s", Pa_GetErrorText(error));
 		if ((error = Pa_Terminate()) != paNoError)
@@ -733,6 +5804,81 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (keyer) {
+		const PaStreamInfo *si = Pa_GetStreamInfo(pars.sp_stream);
+		u_int block;
+
+		/*
+		 * Queue only a few blocks ahead so that keyed text is heard
+		 * right away; main_loop is woken to refill at half that.
+		 */
+		block = pars.sp_blocksize;
+		if (si != NULL && si->outputLatency * pars.sp_rate > block)
+			block = si->outputLatency * pars.sp_rate;
+		if (block == 0)
+			block = KEYER_FRAMES;
+		pars.sp_sampthresh = 4 * block;
+		pars.sp_lowat = pars.sp_sampthresh / 2;
+	}
+	if (keyer || diagmode > 0) {
+		const PaStreamInfo *si = Pa_GetStreamInfo(pars.sp_stream);
+
+		fprintf(stderr, "output latency %.1f ms, %u frames per "
+		    "buffer, queue %u frames\n",
+		    si != NULL ? si->outputLatency * 1000.0 : -1.0,
+		    pars.sp_blocksize, pars.sp_sampthresh);
+	}
+
+	/* the callback renders in the engines' format from the start */
+	for (i = 0; i < pars.sp_nvoices; i++) {
+		struct voice *v = &pars.sp_voices[i];
+
+		/* mixed voices are summed in float */
+		v->v_fmt = v->v_mix ? SF_F32 : pars.sp_fmt;
+		if (engine_configure(v->v_eng, pars.sp_rate, v->v_fmt,
+		    pars.sp_blocksize, v->v_owpm, v->v_cwpm, v->v_hz) != 0)
+			errx(1, "unable to build sounds");
+		v->v_tl = NULL;
+		if (seekable && v->v_in.ib_mapped) {
+			/* all of it, played and sought in by the callback */
+			v->v_tl = x_malloc(sizeof(*v->v_tl));
+			tl_build(v->v_tl, v->v_eng->e_ss, v->v_in.ib_buf,
+			    v->v_in.ib_len);
+			tl_index(v->v_tl, v->v_eng->e_ss, v->v_in.ib_buf,
+			    v->v_in.ib_len);
+			mem_lock(v->v_tl, sizeof(*v->v_tl));
+			mem_lock(v->v_tl->tl_ent,
+			    v->v_tl->tl_n * sizeof(*v->v_tl->tl_ent));
+			mem_lock(v->v_tl->tl_start,
+			    (v->v_tl->tl_n + 1) * sizeof(*v->v_tl->tl_start));
+			engine_timeline(v->v_eng, v->v_tl);
+			v->v_eof = 1;
+		}
+	}
+
+	/* a report on demand */
+	stats_wakefd = pars.sp_wakefd[1];
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stats_sig;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+#ifdef SIGINFO
+	sigaction(SIGINFO, &sa, NULL);
+#endif
+	pars.sp_stat0 = mono_ns();
+	pars.sp_statnext = pars.sp_stat0 + pars.sp_statint * 1e9;
+
+	if (ahead > 0) {
+		/* a head start before the stream asks for anything */
+		rq_init(&pars, ahead, pars.sp_blocksize ? pars.sp_blocksize :
+		    RQ_FRAMES);
+		if ((errno = pthread_create(&pars.sp_rq->rq_tid, NULL, rq_main,
+		    &pars)) != 0)
+			err(1, "pthread_create");
+		while (atomic_load(&pars.sp_rq->rq_tail) < ahead)
+			Pa_Sleep(1);
+	}
 	if ((error = Pa_StartStream(pars.sp_stream)) != paNoError) {
 		warn("portaudio: StartStream: %s", Pa_GetErrorText(error));
 		Pa_CloseStream(pars.sp_stream);
@@ -741,17 +5887,41 @@ main(int argc, char *argv[])
 	}
 
 	if (diagmode > 0) {
-		check_chars();
-		test_times(&pars);
+		test_times(pars.sp_rate, 1.0, njobs, 0);
+		synth_check(&pars);
 		return (0);
 	}
 
-	playlist_init();
-	init_sounds();
-	build_sounds(&pars);
+	if (pars.sp_ctl != NULL && (errno = pthread_create(&pars.sp_ctltid,
+	    NULL, ctl_main, &pars)) != 0)
+		err(1, "pthread_create");
 	main_loop(&pars);
-	destroy_sounds();
-	playlist_destroy();
+	if (pars.sp_rq != NULL)
+		rq_stop(&pars);
+	if (pars.sp_rt)
+		rt_check(&pars);
+	if (pars.sp_statint > 0.0)
+		stats_report(&pars);
+	if (pars.sp_ctl != NULL) {
+		pthread_cancel(pars.sp_ctltid);
+		pthread_join(pars.sp_ctltid, NULL);
+	}
+	/* stop the callback before pulling the sounds out from under it */
+	Pa_StopStream(pars.sp_stream);
+	Pa_CloseStream(pars.sp_stream);
+	for (i = 0; i < pars.sp_nvoices; i++) {
+		engine_destroy(pars.sp_voices[i].v_eng);
+		if (pars.sp_voices[i].v_tl != NULL) {
+			tl_free(pars.sp_voices[i].v_tl);
+			x_free(pars.sp_voices[i].v_tl);
+		}
+		in_close(&pars.sp_voices[i].v_in);
+	}
+	x_free(pars.sp_voices);
+	if (pars.sp_rq != NULL)
+		rq_free(pars.sp_rq);
+	close(pars.sp_wakefd[0]);
+	close(pars.sp_wakefd[1]);
 
 	if ((error = Pa_Terminate()) != paNoError)
 		err(1, "portaudio: %s", Pa_GetErrorText(error));
@@ -765,30 +5935,318 @@ mp_callback(const void *inputBuffer, void *outputBuffer,
 	    const PaStreamCallbackTimeInfo *timeInfo,
 	    PaStreamCallbackFlags statusFlags,
 	    void *userData) {
-	float *out = outputBuffer;
-	unsigned int i;
+	struct s_params *pars = userData;
+	u_int64_t t0, dac;
 
-	for (i = 0; i < framesPerBuffer; i++) {
-		struct play_list *e;
-		
-		if (STAILQ_EMPTY(&playhead.l)) {
-			/* nothing queued, play silence */
-			*out++ = 0.0f;
-			*out++ = 0.0f;
-			continue;
-		}
+	if (pars->sp_rt && !pars->sp_rtdone) {
+		/* portaudio's thread: the first we see of it is here */
+		rt_error(&pars->sp_stats, rt_thread(RT_PRIO, pars->sp_rtcpu));
+		pars->sp_rtdone = 1;
+	}
+	t0 = dac = mono_ns();
+	if (pars->sp_rq != NULL)
+		rq_play(pars, outputBuffer, framesPerBuffer * pars->sp_chans *
+		    sf_bps[pars->sp_fmt]);
+	else {
+		if (timeInfo != NULL &&
+		    timeInfo->outputBufferDacTime > timeInfo->currentTime)
+			dac += (timeInfo->outputBufferDacTime -
+			    timeInfo->currentTime) * 1e9;
+		render_block(pars, outputBuffer, framesPerBuffer, dac);
+	}
+	stats_callback(pars, statusFlags, t0);
+	return (0);
+}
 
-		e = STAILQ_FIRST(&playhead.l);
-		*out++ = *e->pl_ptr;
-		*out++ = *e->pl_ptr;
-		e->pl_ptr++;
-		e->pl_res--;
-		playhead.nsamps--;
-		if (e->pl_res == 0) {
-			playhead.nent--;
-			STAILQ_REMOVE_HEAD(&playhead.l, pl_nxt);
-			pl_free(e);
+/*
+ * Mix every voice into frames of output, to be heard at dac.
+ */
+void
+render_block(struct s_params *pars, void *outp, u_int frames, u_int64_t dac)
+{
+	struct voice *v = pars->sp_voices;
+	u_char *out = outp;
+	u_int i, n, left;
+
+	for (i = 0; i < pars->sp_nvoices; i++)
+		pars->sp_voices[i].v_eng->e_dac = dac;
+
+	if (pars->sp_nvoices == 1 && !v->v_mix)
+		engine_render(v->v_eng, out, frames, pars->sp_chans,
+		    NULL);
+	else if (pars->sp_fmt == SF_F32 && pars->sp_chans == 2) {
+		/* mix straight into the output */
+		memset(out, 0, frames * 2 * sizeof(float));
+		for (i = 0; i < pars->sp_nvoices; i++, v++)
+			engine_render(v->v_eng, out, frames, 2,
+			    v->v_gain);
+	} else {
+		for (left = frames; left > 0; left -= n) {
+			n = left < MIX_FRAMES ? left : MIX_FRAMES;
+			memset(pars->sp_mix, 0, n * 2 * sizeof(float));
+			for (i = 0, v = pars->sp_voices; i < pars->sp_nvoices;
+			    i++, v++)
+				engine_render(v->v_eng, pars->sp_mix, n, 2,
+				    v->v_gain);
+			mix_out(out, pars->sp_fmt, pars->sp_chans,
+			    pars->sp_mix, n);
+			out += n * pars->sp_chans * sf_bps[pars->sp_fmt];
 		}
 	}
+	wake_main(pars);
+}
+
+/*
+ * Set up to render ahead blocks of frames ahead; rq_main() is started
+ * separately.
+ */
+void
+rq_init(struct s_params *pars, u_int ahead, u_int frames)
+{
+	struct render_q *rq;
+	const PaStreamInfo *si;
+
+	rq = x_malloc(sizeof(*rq));
+	memset(rq, 0, sizeof(*rq));
+	rq->rq_ahead = ahead;
+	rq->rq_frames = frames;
+	rq->rq_len = (size_t)frames * pars->sp_chans * sf_bps[pars->sp_fmt];
+	rq->rq_stride = (rq->rq_len + RQ_ALIGN - 1) & ~(size_t)(RQ_ALIGN - 1);
+	if ((errno = posix_memalign((void **)&rq->rq_buf, RQ_ALIGN,
+	    ahead * rq->rq_stride)) != 0)
+		err(1, "posix_memalign");
+	atomic_init(&rq->rq_head, 0);
+	atomic_init(&rq->rq_tail, 0);
+	atomic_init(&rq->rq_stop, 0);
+	mem_lock(rq, sizeof(*rq));
+	mem_lock(rq->rq_buf, ahead * rq->rq_stride);
+	if (pars->sp_stream != NULL &&
+	    (si = Pa_GetStreamInfo(pars->sp_stream)) != NULL)
+		rq->rq_latency = si->outputLatency * 1e9;
+	pars->sp_rq = rq;
+}
+
+void
+rq_free(struct render_q *rq)
+{
+	free(rq->rq_buf);
+	x_free(rq);
+}
+
+/*
+ * Render the block at the tail of the queue, if there is room for it.
+ * It will be heard once the blocks ahead of it and the stream's own
+ * latency have played.
+ */
+int
+rq_fill(struct s_params *pars)
+{
+	struct render_q *rq = pars->sp_rq;
+	u_int head, tail;
+	u_int64_t dac;
+
+	head = atomic_load_explicit(&rq->rq_head, memory_order_acquire);
+	tail = atomic_load_explicit(&rq->rq_tail, memory_order_relaxed);
+	if (tail - head >= rq->rq_ahead)
+		return (-1);
+	dac = mono_ns() + rq->rq_latency + (u_int64_t)(tail - head) *
+	    rq->rq_frames * 1000000000 / pars->sp_rate;
+	render_block(pars, rq->rq_buf + (tail % rq->rq_ahead) * rq->rq_stride,
+	    rq->rq_frames, dac);
+	atomic_store_explicit(&rq->rq_tail, tail + 1, memory_order_release);
 	return (0);
 }
+
+/*
+ * The render thread: fill the queue, then sleep while half of it plays.
+ */
+void *
+rq_main(void *arg)
+{
+	struct s_params *pars = arg;
+	struct render_q *rq = pars->sp_rq;
+	struct timespec ts;
+	u_int64_t ns;
+
+	ns = (u_int64_t)rq->rq_frames * (rq->rq_ahead / 2) * 1000000000 /
+	    pars->sp_rate;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	if (pars->sp_rt)
+		rt_error(&pars->sp_stats, rt_thread(RT_PRIO - 1, -1));
+	while (!atomic_load(&rq->rq_stop))
+		if (rq_fill(pars) != 0)
+			nanosleep(&ts, NULL);
+	return (NULL);
+}
+
+/*
+ * Stop the render thread, then let the callback play what it left.
+ */
+void
+rq_stop(struct s_params *pars)
+{
+	struct render_q *rq = pars->sp_rq;
+	long ms;
+
+	atomic_store(&rq->rq_stop, 1);
+	pthread_join(rq->rq_tid, NULL);
+	ms = (long)rq->rq_frames * 1000 / pars->sp_rate + 1;
+	while (atomic_load(&rq->rq_head) != atomic_load(&rq->rq_tail))
+		Pa_Sleep(ms);
+}
+
+/*
+ * The callback's side: copy len bytes out of the queue, and silence for
+ * whatever the render thread has not got to in time.
+ */
+void
+rq_play(struct s_params *pars, u_char *out, size_t len)
+{
+	struct render_q *rq = pars->sp_rq;
+	u_int head, tail;
+	size_t n;
+
+	head = atomic_load_explicit(&rq->rq_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&rq->rq_tail, memory_order_acquire);
+	while (len > 0) {
+		if (head == tail) {
+			memset(out, 0, len);
+			atomic_fetch_add_explicit(&pars->sp_stats.ms_starved,
+			    1, memory_order_relaxed);
+			break;
+		}
+		n = rq->rq_len - rq->rq_off;
+		if (n > len)
+			n = len;
+		memcpy(out, rq->rq_buf + (head % rq->rq_ahead) *
+		    rq->rq_stride + rq->rq_off, n);
+		out += n;
+		len -= n;
+		if ((rq->rq_off += n) == rq->rq_len) {
+			rq->rq_off = 0;
+			atomic_store_explicit(&rq->rq_head, ++head,
+			    memory_order_release);
+		}
+	}
+}
+
+/*
+ * Copy n mono samples of bps bytes each into chans interleaved channels.
+ */
+void
+copy_frames(void *out, const void *in, u_int n, u_int bps, u_int chans)
+{
+	const u_char *s = in;
+	u_char *d = out;
+	u_int i;
+
+	if (chans == 1) {
+		memcpy(out, in, n * bps);
+		return;
+	}
+	switch (bps) {
+	case 4:
+		/* any four byte sample copies like a float */
+		mono_to_stereo(out, in, n);
+		break;
+	case 2:
+		for (i = 0; i < n; i++, s += 2, d += 4) {
+			memcpy(d, s, 2);
+			memcpy(d + 2, s, 2);
+		}
+		break;
+	default:
+		for (i = 0; i < n; i++, s += bps, d += 2 * bps) {
+			memcpy(d, s, bps);
+			memcpy(d + bps, s, bps);
+		}
+		break;
+	}
+}
+
+/*
+ * Convert n frames of float stereo mix into chans channels of format fmt.
+ * Mono is the sum of the two sides scaled so that a centered voice keeps
+ * its level.  Clobbers mix.
+ */
+void
+mix_out(void *out, int fmt, u_int chans, float *mix, u_int n)
+{
+	u_int i;
+
+	if (chans == 1) {
+		for (i = 0; i < n; i++)
+			mix[i] = (mix[2 * i] + mix[2 * i + 1]) *
+			    (float)M_SQRT1_2;
+		put_samples(out, fmt, mix, n);
+	} else
+		put_samples(out, fmt, mix, 2 * n);
+}
+
+/*
+ * Duplicate n mono samples into interleaved left/right pairs.
+ */
+void
+mono_to_stereo(float *out, const float *in, u_int n)
+{
+	u_int i = 0;
+
+#if defined(__SSE__)
+	for (; i + 4 <= n; i += 4) {
+		__m128 v = _mm_loadu_ps(in + i);
+
+		_mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(v, v));
+		_mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(v, v));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 4 <= n; i += 4) {
+		float32x4x2_t v;
+
+		v.val[0] = v.val[1] = vld1q_f32(in + i);
+		vst2q_f32(out + 2 * i, v);
+	}
+#endif
+	for (; i < n; i++) {
+		out[2 * i] = in[i];
+		out[2 * i + 1] = in[i];
+	}
+}
+
+/*
+ * Add n mono samples into interleaved left/right pairs, scaled by
+ * gain[0] and gain[1].
+ */
+void
+mix_stereo(float *out, const float *in, u_int n, const float *gain)
+{
+	u_int i = 0;
+
+#if defined(__SSE__)
+	__m128 gl = _mm_set1_ps(gain[0]), gr = _mm_set1_ps(gain[1]);
+
+	for (; i + 4 <= n; i += 4) {
+		__m128 v = _mm_loadu_ps(in + i);
+		__m128 l = _mm_mul_ps(v, gl), r = _mm_mul_ps(v, gr);
+		float *o = out + 2 * i;
+
+		_mm_storeu_ps(o, _mm_add_ps(_mm_loadu_ps(o),
+		    _mm_unpacklo_ps(l, r)));
+		_mm_storeu_ps(o + 4, _mm_add_ps(_mm_loadu_ps(o + 4),
+		    _mm_unpackhi_ps(l, r)));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 4 <= n; i += 4) {
+		float32x4_t v = vld1q_f32(in + i);
+		float32x4x2_t o = vld2q_f32(out + 2 * i);
+
+		o.val[0] = vmlaq_n_f32(o.val[0], v, gain[0]);
+		o.val[1] = vmlaq_n_f32(o.val[1], v, gain[1]);
+		vst2q_f32(out + 2 * i, o);
+	}
+#endif
+	for (; i < n; i++) {
+		out[2 * i] += in[i] * gain[0];
+		out[2 * i + 1] += in[i] * gain[1];
+	}
+}